@@ -0,0 +1,104 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * Pack file written by mkpack and served by `root_pack`, all integers in
+ * host byte order:
+ *
+ *   PackHeader
+ *   PackBucket[bucketCount]  open addressing on the URL path hash
+ *   PackAsset[assetCount]    one per file, shared by the URLs naming it
+ *   strings                  URL paths, content types, ETags
+ *   data                     file contents and their .gz variants, each
+ *                            starting on a PACK_ALIGN boundary
+ *
+ * A bucket with asset 0 is empty, others hold the asset's index + 1.
+ */
+static const char PACK_MAGIC[8] = {'W', 'S', 'P', 'A', 'C', 'K', '\0', '\0'};
+static const uint32_t PACK_VERSION = 2;
+static const size_t PACK_ALIGN = 64;
+
+struct PackHeader
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	bucketCount;
+	uint32_t	assetCount;
+	uint32_t	reserved;
+	uint64_t	bucketsOffset;
+	uint64_t	assetsOffset;
+	uint64_t	fileSize;
+};
+
+struct PackBucket
+{
+	uint64_t	hash;
+	uint64_t	pathOffset;
+	uint32_t	pathLength;
+	uint32_t	asset;
+};
+
+struct PackAsset
+{
+	uint64_t	dataOffset;
+	uint64_t	dataLength;
+	uint64_t	gzipOffset;
+	uint64_t	gzipLength; // 0: no precompressed variant
+	uint64_t	typeOffset;
+	uint64_t	etagOffset;
+	uint64_t	gzipEtagOffset; // the .gz variant's own ETag, a hash of its bytes
+	uint32_t	typeLength;
+	uint32_t	etagLength;
+	uint32_t	gzipEtagLength;
+	uint32_t	reserved;
+};
+
+/**
+ * AssetPack → a pack file mapped read-only for the life of the server and
+ * shared by every worker; lookups and the bytes sent point into the
+ * mapping, nothing is read from disk per request. The whole file is
+ * checked once when opened, so lookups trust its offsets.
+ */
+class AssetPack
+{
+public:
+	/**
+	 * Asset → what find() resolved a URL path to
+	 * data / gzip → the file's bytes, and its .gz variant (NULL when none)
+	 * contentType / etag → chosen by mkpack, the ETag includes its quotes
+	 */
+	struct Asset
+	{
+		const char	*data = NULL;
+		size_t		length = 0;
+		const char	*gzip = NULL;
+		size_t		gzipLength = 0;
+		std::string	contentType;
+		std::string	etag;
+		std::string	gzipEtag;
+	};
+
+	~AssetPack();
+	AssetPack(const AssetPack &) = delete;
+	AssetPack &operator=(const AssetPack &) = delete;
+
+	static std::shared_ptr<const AssetPack> open(const std::string &path, std::string &error);
+	bool find(const std::string &path, Asset &asset) const;
+	size_t assetCount() const { return m_header->assetCount; }
+
+private:
+	AssetPack();
+
+	const char *m_base;
+	size_t m_size;
+	const PackHeader *m_header;
+
+	bool validate(std::string &error) const;
+	bool inBounds(uint64_t offset, uint64_t length) const;
+};
+
+uint64_t packHash(const char *data, size_t length);
+bool writeAssetPack(const std::string &docroot, const std::string &index, const std::string &output,
+					size_t &assets, std::string &error);
+void loadAssetPacks(Config_struct &config);
@@ -1,6 +1,11 @@
 #pragma once
 #include <map>
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <deque>
+#include <atomic>
+#include <sys/types.h>
 
 struct CgiResult {
     int status = 200;
@@ -10,7 +15,124 @@ struct CgiResult {
 
 
 class Request;
+struct FastCgiUpstream;
+struct FastCgiConnection;
+struct CgiZygote;
+struct Location_struct;
 
-CgiResult runCgi(const Request& req,
-                 const std::string& scriptPath,
-                 const std::string& interpreter);
+typedef std::vector<std::pair<std::string, std::string> > CgiParams;
+
+/**
+ * CgiProcess → a running CGI child as the event loop sees it
+ * stdinFd / stdoutFd → non-blocking parent ends of the child's pipes
+ * pidFd → becomes readable when the child exits (-1 if the kernel lacks pidfd_open)
+ * zygote → set when the child was forked by a CGI zygote; pid stays -1 until
+ *   the zygote reports it, pidFd then only serves to signal the child
+ */
+struct CgiProcess {
+    pid_t pid = -1;
+    int pidFd = -1;
+    CgiZygote* zygote = NULL;
+    int stdinFd = -1;
+    int stdoutFd = -1;
+};
+
+/**
+ * CgiJob → one CGI request in flight on a connection
+ * proc → the forked script (pid -1 when the request went to FastCGI)
+ * fastCgiPool / fastCgiConn / fastCgiId → FastCGI upstream, the pooled
+ *   connection carrying the request (NULL while queued) and its request id
+ * location / scriptPath → where the request is sent once it holds a slot
+ * params → meta-variables, kept until the request is started or encoded
+ * started → the request left the admission queue and holds a slot
+ * deadlineMs → when the request is answered with 504; once streaming, when
+ *   a script that stopped writing gets its connection cut
+ * input / inputSent → request body not handed to the child yet, and how
+ *   much of that buffer is already written
+ * inputOpen → the body is still arriving and goes to stdin piece by piece
+ * inputBlocked → stdin is full, the client is not read until it drains
+ * output → stdout read from the child and not relayed to the client yet
+ * streaming → the header block was complete and the response head is
+ *   queued; from then on output is passed on as it arrives
+ * buffered → the answer cannot be streamed (HTTP/1.0 client without a
+ *   Content-Length from the script) and is sent once the script is done
+ * chunked / bodyLeft → framing of a streamed body: chunked encoding, or
+ *   the bytes still owed to the script's own Content-Length
+ * outputPaused → stdout is out of the event loop until the client catches up
+ * outputDone / exited → stdout reached EOF / the child was reaped
+ * cacheKey → the answer goes to the cgi_cache under this key, so it is
+ *   collected whole instead of streamed (empty once it turned out not cacheable)
+ * refresh → background request renewing a stale cache entry: its
+ *   connection has no socket and the answer only goes to the cache
+ * waiting → runs nothing and holds no slot: another request with the same
+ *   cacheKey is in flight and its answer is shared (see CgiFlight)
+ */
+struct CgiJob {
+    CgiProcess proc;
+    int clientFd = -1;
+    FastCgiUpstream* fastCgiPool = NULL;
+    FastCgiConnection* fastCgiConn = NULL;
+    uint16_t fastCgiId = 0;
+    const Location_struct* location = NULL;
+    std::string scriptPath;
+    CgiParams params;
+    bool started = false;
+    uint64_t deadlineMs = 0;
+    Request request;
+    std::string input;
+    size_t inputSent = 0;
+    bool inputOpen = false;
+    bool inputBlocked = false;
+    std::string output;
+    bool streaming = false;
+    bool buffered = false;
+    bool chunked = false;
+    size_t bodyLeft = 0;
+    bool outputPaused = false;
+    bool outputDone = false;
+    bool exited = false;
+    int waitStatus = 0;
+    std::string cacheKey;
+    bool refresh = false;
+    bool waiting = false;
+};
+
+/**
+ * CgiLocationStats → counters of one CGI location, shared by all workers;
+ *   running and queued are also the slots and queue places the workers
+ *   take (compare-exchange), so cgi_max_concurrent and cgi_queue_size hold
+ *   for the whole process; abandoned counts requests whose client left
+ *   before the answer,
+ *   cacheHits / cacheStale / cacheMisses how cgi_cache lookups went,
+ *   cacheCoalesced the misses that waited for a request already in flight
+ * CgiLimit → one CGI location in one worker: the FIFO of its requests
+ *   waiting for a slot, which any worker may free
+ */
+struct CgiLocationStats {
+    std::atomic<size_t> running{0};
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> rejected{0};
+    std::atomic<size_t> timedOut{0};
+    std::atomic<size_t> abandoned{0};
+    std::atomic<size_t> cacheHits{0};
+    std::atomic<size_t> cacheStale{0};
+    std::atomic<size_t> cacheMisses{0};
+    std::atomic<size_t> cacheCoalesced{0};
+};
+
+struct CgiLimit {
+    std::deque<CgiJob*> queue;
+    CgiLocationStats* stats = NULL;
+};
+
+CgiLocationStats& cgiLocationStats(const Location_struct* location);
+CgiParams buildCgiParams(const Request& req, const std::string& scriptPath, int clientFd);
+std::vector<std::string> buildCgiEnvironment(const CgiParams& params);
+bool openCgiPipes(int inPipe[2], int outPipe[2]);
+bool spawnCgi(const CgiParams& params,
+              const std::string& scriptPath,
+              const std::string& interpreter,
+              CgiProcess& proc);
+size_t findCgiHeaderEnd(const std::string& out, size_t& bodyStart);
+void parseCgiHeaders(const std::string& head, CgiResult& r);
+CgiResult parseCgiOutput(const std::string& out, int waitStatus);
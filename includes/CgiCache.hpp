@@ -0,0 +1,71 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * CgiCacheEntry → one CGI answer kept by `cgi_cache`: status, the headers
+ *   as the script sent them (lowercase names) and the body
+ * storedAt → when the script produced it, Age is counted from there
+ * freshUntil → served as is until then
+ * staleUntil → past freshUntil it is still served while a refresh runs,
+ *   past staleUntil it is dropped and the next request waits for the script
+ * refreshing → a background request for this entry is running
+ */
+struct CgiCacheEntry
+{
+	int									status = 200;
+	std::map<std::string, std::string>	headers;
+	std::string							body;
+	time_t								storedAt = 0;
+	time_t								freshUntil = 0;
+	time_t								staleUntil = 0;
+	bool								refreshing = false;
+};
+
+/**
+ * CgiCache → the cached CGI answers of one worker, keyed by cgiCacheKey().
+ * Entries are evicted least recently used once their bodies and headers
+ * take more than maxBytes; nothing is shared between workers, so each one
+ * runs the script once per expiry.
+ */
+class CgiCache
+{
+public:
+	enum State
+	{
+		MISS,
+		FRESH,
+		STALE
+	};
+
+	explicit CgiCache(size_t maxBytes = 16 * MB);
+
+	State lookup(const std::string &key, time_t now, CgiCacheEntry *&entry);
+	CgiCacheEntry *find(const std::string &key);
+	void store(const std::string &key, CgiCacheEntry &entry);
+	void erase(const std::string &key);
+
+private:
+	typedef std::list<std::pair<std::string, CgiCacheEntry> > Entries;
+
+	Entries m_entries; // most recently used first
+	std::unordered_map<std::string, Entries::iterator> m_index;
+	size_t m_bytes;
+	size_t m_maxBytes;
+
+	static size_t entrySize(const std::string &key, const CgiCacheEntry &entry);
+};
+
+/**
+ * CgiFlight → the request producing a cache key right now (a client's or a
+ *   refresh) and the clients that missed on that key meanwhile; they wait
+ *   for its answer instead of running the script once each
+ */
+struct CgiFlight
+{
+	CgiJob				*leader = NULL;
+	std::vector<int>	waiters;
+};
+
+std::string cgiCacheKey(const Request &request, const Location_struct &location);
+bool cgiCacheFreshness(const CgiResult &result, const Location_struct &location, time_t now, CgiCacheEntry &entry);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * CgiZygote → a pre-started Python interpreter (`cgi_zygote on`) that forks
+ * one ready child per request instead of paying interpreter startup and
+ * imports every time. The server talks to it over a SOCK_SEQPACKET
+ * socketpair, one message per request: the script path and its "NAME=value"
+ * environment, with the script's stdin/stdout pipe ends attached.
+ * The zygote answers "P <pid>" (with a pidfd attached when it can) as soon
+ * as the child exists and "X <pid> <wait status>" once it reaped it.
+ *
+ * fd → the server's end of the socketpair, registered in the event loop
+ * pending → jobs whose "P" message has not arrived yet, in request order
+ *   (NULL once the client went away)
+ * running → child pid → job it answers
+ */
+struct CgiZygote
+{
+	pid_t								pid = -1;
+	int									fd = -1;
+	std::string							interpreter;
+	std::deque<CgiJob *>				pending;
+	std::unordered_map<pid_t, CgiJob *>	running;
+};
+
+bool isZygoteInterpreter(const std::string &interpreter);
+bool startCgiZygote(const std::string &interpreter, CgiZygote &zygote);
+bool sendCgiZygoteRequest(CgiZygote &zygote, const CgiParams &params, const std::string &scriptPath, CgiProcess &proc);
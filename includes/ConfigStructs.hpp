@@ -7,9 +7,24 @@
  * methods → HTTP methods allowed for this location
  * upload_path →  folder to store uploaded files
  * cgi_extension → if requests with this extension should trigger CGI
+ * fastcgi_pass → FastCGI application (unix:/path or host:port) answering those requests instead of cgi_path
+ * fastcgi_addr / fastcgi_addrlen → fastcgi_pass resolved by the parser, so workers never look up names
+ * cgi_zygote → Python scripts are forked from a pre-started cgi_path interpreter instead of a fresh one
+ * cgi_timeout → seconds a CGI request may take, time spent queued included (504 after)
+ * cgi_max_concurrent → CGI requests of this location running at once over all workers (0: no limit)
+ * cgi_queue_size → requests waiting for a free slot before new ones get 503 + Retry-After
+ * cgi_stats → this location answers with the CGI running/queued/rejected counters
+ * cgi_cache → seconds a GET answer of this location's scripts is kept in memory when the script
+ *   sends no Cache-Control max-age or Expires of its own (0: off)
+ * cgi_cache_stale → seconds an expired answer is still served while one background request refreshes it
+ * cgi_cache_vary → request headers whose values are part of the cache key
+ * root_pack → pack file (mkpack) static GETs are answered from instead of root
+ * pack → that pack, mapped by loadAssetPacks()
  * redirect →  HTTP redirect
  */
 
+class AssetPack;
+
 struct Location_struct {
 	std::string					path;
 	std::string					root;
@@ -18,6 +33,19 @@ struct Location_struct {
 	std::string					upload_path;
 	std::string					cgi_extension;
 	std::string					cgi_path;
+	std::string					fastcgi_pass;
+	struct sockaddr_storage		fastcgi_addr = {};
+	socklen_t					fastcgi_addrlen = 0;
+	bool						cgi_zygote = false;
+	int							cgi_timeout = 3;
+	size_t						cgi_max_concurrent = 0;
+	size_t						cgi_queue_size = 64;
+	bool						cgi_stats = false;
+	int							cgi_cache = 0;
+	int							cgi_cache_stale = 10;
+	std::vector<std::string>	cgi_cache_vary;
+	std::string					root_pack;
+	std::shared_ptr<const AssetPack>	pack;
 	std::string					redirect;
 	int							redirect_code; // 301, 302, 307, 308
     std::string					redirect_url; // target URL
@@ -31,8 +59,18 @@ struct Location_struct {
  * client_max_body_size → limit for POST/PUT requests
  * error_pages → maps HTTP codes (404, 500) to files
  * locations → list of all Location structs for sub-paths
+ * keepalive_timeout → seconds an idle persistent connection is kept open (0 disables keep-alive)
+ * keepalive_requests → max requests served on one persistent connection
+ * client_header_timeout → seconds to receive a whole request head (408 after)
+ * client_body_timeout → max seconds between two reads of a request body (408 after)
+ * send_timeout → max seconds between two successful writes of a response
+ * root_pack / pack → pack file static GETs are answered from, and its mapping (loadAssetPacks)
+ * error_responses → error_pages read and serialized once (loadErrorPages), swapped
+ *   whole on SIGHUP while workers read it, hence atomic access only
  */
 
+struct ErrorPages;
+
 struct Server_struct {
 	int								listen_port;
 	std::vector<std::string>		server_names;
@@ -41,12 +79,28 @@ struct Server_struct {
 	size_t							client_max_body_size;
 	std::map<int, std::string>		error_pages;
 	std::vector<Location_struct>	locations;
+	int								keepalive_timeout;
+	size_t							keepalive_requests;
+	int								client_header_timeout;
+	int								client_body_timeout;
+	int								send_timeout;
+	std::string						root_pack;
+	std::shared_ptr<const AssetPack>	pack;
+	mutable std::shared_ptr<const ErrorPages>	error_responses;
 };
 
 /**
  * servers → a vector of Server objects
  * Each Server can have multiple Location blocks
+ * event_backend → readiness backend: epoll (level), epoll_et (edge) or poll
+ * worker_threads → number of event loops, each with its own SO_REUSEPORT listeners
+ * open_file_cache → static GET resolutions (open fd, size, type) each worker keeps (0: off)
+ * open_file_cache_responses → bytes of serialized small-file answers each worker keeps with them (0: off)
  */
 struct Config_struct {
 	std::vector<Server_struct>			servers;
+	std::string							event_backend = "epoll";
+	int									worker_threads = 1;
+	size_t								open_file_cache = 0;
+	size_t								open_file_cache_responses = 0;
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * Connection → everything the event loop knows about one client socket
+ * fd / listenerFd → client socket and the listener it was accepted on
+ * server → virtual server chosen by the listening port
+ * inbuf → bytes not parsed yet
+ * output → slices of the responses not sent yet, in request order
+ * framer → incremental framing state of the request at the front of inbuf
+ * interest → EventLoop interest currently registered for fd
+ * requestCount → requests served on this connection (keepalive_requests)
+ * closeAfterWrite → a queued response said "Connection: close"
+ * timerKind → which deadline is pending on the timer wheel
+ * bodyRouted → the body of the current request was already checked for streaming
+ * upload / uploadRequest → upload body being written to disk, and its head
+ * cgi → CGI request in flight; later pipelined requests wait until it answers
+ *
+ * Connections live in an fd-indexed slab owned by Server: lookup is an
+ * array index and close() just resets the slot for the next accept().
+ */
+
+/**
+ * OutputSlice → one piece of a queued response: either bytes in memory
+ * (headers, a generated body), read-only memory shared with whatever owns
+ * it (a cached serialized response, a mapped asset pack), or a file range
+ * sent with sendfile().
+ * sent counts how much of it is already out, so a partial write only
+ * moves that offset instead of shifting the rest of the data.
+ */
+struct OutputSlice
+{
+	std::string					bytes;
+	std::shared_ptr<const void>	owner; // keeps the memory view points into alive
+	const char					*view = NULL;
+	size_t						viewLength = 0;
+	std::shared_ptr<FileBody>	file;
+	size_t						sent = 0;
+
+	void share(const std::shared_ptr<const void> &holder, const char *data, size_t length)
+	{
+		owner = holder;
+		view = data;
+		viewLength = length;
+	}
+	void share(const std::shared_ptr<const std::string> &buffer) { share(buffer, buffer->data(), buffer->size()); }
+	const char *data() const { return view ? view : bytes.data(); }
+	size_t size() const { return file ? file->length : view ? viewLength : bytes.size(); }
+	size_t remaining() const { return size() - sent; }
+};
+
+enum TimerKind
+{
+	TIMER_NONE,
+	TIMER_HEADER,
+	TIMER_BODY,
+	TIMER_SEND,
+	TIMER_KEEPALIVE,
+	TIMER_CGI
+};
+
+struct Connection
+{
+	int							fd = -1;
+	int							listenerFd = -1;
+	const Server_struct			*server = NULL;
+	std::string					inbuf;
+	std::deque<OutputSlice>		output;
+	RequestFramer				framer;
+	unsigned					interest = 0;
+	size_t						requestCount = 0;
+	bool						closeAfterWrite = false;
+	TimerKind					timerKind = TIMER_NONE;
+	bool						bodyRouted = false;
+	std::unique_ptr<UploadStream>	upload;
+	Request						uploadRequest;
+	std::unique_ptr<CgiJob>		cgi;
+
+	bool isOpen() const { return fd >= 0; }
+	bool hasOutput() const { return !output.empty(); }
+	size_t pendingOutput() const;
+	void reset();
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * ErrorPages → the error answers of one virtual server, read from disk once
+ * bodies → page per code, from its error_page file
+ * fallback → root/error.html, for codes without a page (empty when missing)
+ * closing / keepAlive → the complete serialized answer per code, with
+ *   "Connection: close" or with keep-alive and the server's Keep-Alive
+ *   timeout; shared read-only with the connections sending them
+ */
+struct ErrorPages
+{
+	std::map<int, std::string>								bodies;
+	std::string												fallback;
+	std::map<int, std::shared_ptr<const std::string> >	closing;
+	std::map<int, std::shared_ptr<const std::string> >	keepAlive;
+
+	std::string body(int code) const;
+	std::shared_ptr<const std::string> response(int code, bool keepAlive) const;
+};
+
+void loadErrorPages(Config_struct &config);
+void reloadErrorPages(const Config_struct &config);
+std::shared_ptr<const ErrorPages> currentErrorPages(const Server_struct &server);
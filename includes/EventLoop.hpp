@@ -0,0 +1,64 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * EventLoop → readiness notification behind one interface
+ * POLL → portable fallback, pollfd array with an fd → slot index (swap-remove on delete)
+ * EPOLL_LEVEL → epoll, level-triggered (same semantics as poll)
+ * EPOLL_EDGE → epoll, edge-triggered: callers must drain fds until EAGAIN
+ *
+ * add/modify/remove are O(1) per fd with every backend.
+ *
+ * EV_ERROR and EV_HANGUP are always reported; EV_PEER_CLOSED (the peer shut
+ * down its sending side, RDHUP) only when it is part of the interest.
+ */
+
+class EventLoop
+{
+public:
+	enum Backend
+	{
+		POLL,
+		EPOLL_LEVEL,
+		EPOLL_EDGE
+	};
+
+	enum
+	{
+		EV_READ = 1,
+		EV_WRITE = 2,
+		EV_ERROR = 4,
+		EV_HANGUP = 8,
+		EV_PEER_CLOSED = 16
+	};
+
+	struct Event
+	{
+		int fd;
+		unsigned events;
+	};
+
+private:
+	Backend m_backend;
+	int m_epollFd;
+	std::vector<struct epoll_event> m_epollEvents;
+	std::vector<struct pollfd> m_pollFds;
+	std::vector<int> m_pollSlot;
+
+public:
+	EventLoop(Backend backend);
+	~EventLoop();
+	EventLoop(const EventLoop &other) = delete;
+	EventLoop &operator=(const EventLoop &other) = delete;
+
+	bool add(int fd, unsigned interest);
+	bool modify(int fd, unsigned interest);
+	void remove(int fd);
+	int wait(int timeoutMs, std::vector<Event> &ready);
+
+	Backend getBackend() const;
+	bool isEdgeTriggered() const;
+
+	static Backend backendFromName(const std::string &name);
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * FastCGI (version 1) client side: record encoding and the per-worker
+ * connection pool behind `fastcgi_pass unix:/path.sock;` / `host:port;`.
+ *
+ * Every record is an 8 byte header (version, type, request id, content
+ * length, padding) followed by its content. A request is BEGIN_REQUEST,
+ * PARAMS (the CGI meta-variables) and STDIN (the body), each stream closed
+ * by an empty record; the application answers with STDOUT/STDERR records
+ * and one END_REQUEST.
+ */
+
+enum FastCgiRecordType
+{
+	FCGI_BEGIN_REQUEST = 1,
+	FCGI_ABORT_REQUEST = 2,
+	FCGI_END_REQUEST = 3,
+	FCGI_PARAMS = 4,
+	FCGI_STDIN = 5,
+	FCGI_STDOUT = 6,
+	FCGI_STDERR = 7,
+	FCGI_GET_VALUES = 9,
+	FCGI_GET_VALUES_RESULT = 10
+};
+
+static const size_t FCGI_HEADER_LEN = 8;
+static const size_t FCGI_MAX_CONTENT = 65535;
+
+/**
+ * FastCgiConnection → one pooled socket to the application
+ * connected → the non-blocking connect() finished
+ * capacity → requests allowed in flight at once: 1 until the application
+ *   answers FCGI_GET_VALUES with FCGI_MPXS_CONNS=1
+ * outbuf / outSent → records not written yet
+ * inbuf → bytes of records not complete yet
+ * requests → request id → job it answers (NULL once the client went away)
+ * aborted → ids sent FCGI_ABORT_REQUEST → when the connection is given up
+ *   if the application has still not ended them; the socket's fd is their
+ *   timer id on the worker's wheel
+ */
+struct FastCgiConnection
+{
+	int								fd = -1;
+	FastCgiUpstream					*pool = NULL;
+	bool							connected = false;
+	size_t							capacity = 1;
+	std::string						outbuf;
+	size_t							outSent = 0;
+	std::string						inbuf;
+	std::map<uint16_t, CgiJob *>	requests;
+	std::map<uint16_t, uint64_t>	aborted;
+	uint16_t						nextId = 1;
+
+	uint16_t allocateId();
+};
+
+/**
+ * FastCgiUpstream → the connections to one fastcgi_pass address
+ * addr / addrLength → that address, resolved when the config was loaded
+ * waiting → jobs queued until a connection has room for them
+ */
+struct FastCgiUpstream
+{
+	std::string										address;
+	struct sockaddr_storage							addr;
+	socklen_t										addrLength = 0;
+	std::vector<std::unique_ptr<FastCgiConnection> >	conns;
+	std::deque<CgiJob *>							waiting;
+};
+
+bool resolveFastCgiAddress(const std::string &address, struct sockaddr_storage &out, socklen_t &length,
+						   std::string &error);
+int fastCgiConnect(const struct sockaddr_storage &addr, socklen_t length);
+
+void fastCgiAppendRecord(std::string &out, unsigned char type, uint16_t id, const char *data, size_t len);
+void fastCgiAppendParam(std::string &out, const std::string &name, const std::string &value);
+void fastCgiEncodeRequest(std::string &out, uint16_t id, const CgiParams &params, const std::string &body);
+void fastCgiEncodeGetValues(std::string &out);
+std::map<std::string, std::string> fastCgiDecodeParams(const char *data, size_t len);
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * OpenFile → what a static GET resolved to
+ * body → the open file and its size, shared with every response sending it
+ *   (NULL when the target is a directory without index, listed each time)
+ * path → canonical path of the file sent, or of the directory listed
+ * mtime → modification time when the file was opened
+ * contentType → Content-Type chosen from the extension
+ * missing → neither the target nor its ".html" fallback exists (404)
+ */
+struct OpenFile
+{
+	std::shared_ptr<FileBody>	body;
+	std::string					path;
+	time_t						mtime = 0;
+	std::string					contentType;
+	bool						missing = false;
+};
+
+/**
+ * OpenFileCache → `open_file_cache N`: the last N static GET resolutions
+ * of one worker, keyed by docroot, index and URL path, so a hit costs no
+ * path syscall at all (no stat, canonicalization or open()).
+ *
+ * Every entry remembers the paths its resolution looked at (the target,
+ * the ".html" fallback, the index) and an inotify watch is kept on each
+ * directory from the docroot down to them. Any change under one of those
+ * paths (write, attribute change, create, delete, rename, of the file or
+ * of a directory above it) drops the entries depending on it; the inotify
+ * fd is polled by the event loop. Without inotify the cache stays empty.
+ *
+ * Paths that resolved to nothing are kept too, so repeated 404s cost no
+ * syscall either. They only watch the directories that exist on the way:
+ * creating any missing one shows up in its parent. They have an LRU of
+ * their own, also N long, so a scan of missing URLs cannot push out the
+ * files actually served.
+ *
+ * With `open_file_cache_responses B` an entry hit at least once also keeps
+ * the complete response of a small file (status line, headers and body) as
+ * it was serialized, one per protocol version and Connection header. Those
+ * buffers are shared read-only with the connections sending them, take at
+ * most B bytes (least recently used go first) and are dropped along with
+ * their entry.
+ */
+class OpenFileCache
+{
+public:
+	OpenFileCache();
+	~OpenFileCache();
+	OpenFileCache(const OpenFileCache &) = delete;
+	OpenFileCache &operator=(const OpenFileCache &) = delete;
+
+	bool enable(size_t maxEntries, size_t maxResponseBytes = 0);
+	void disable();
+	int fd() const { return m_fd; }
+	const OpenFile *find(const std::string &key);
+	void store(const std::string &key,
+			   const OpenFile &file,
+			   const std::string &root,
+			   const std::vector<std::string> &paths);
+	std::shared_ptr<const std::string> findResponse(const std::string &key, const std::string &variant);
+	bool wantsResponse(const std::string &key, size_t length) const;
+	void storeResponse(const std::string &key, const std::string &variant, const std::shared_ptr<const std::string> &bytes);
+	void handleEvents();
+
+private:
+	struct Entry
+	{
+		OpenFile						file;
+		std::vector<std::string>		paths;
+		std::vector<std::string>		dirs;
+		std::list<std::string>::iterator	lru;
+		size_t							hits = 0;
+		std::map<std::string, std::shared_ptr<const std::string> >	responses; // variant → serialized
+		std::list<std::string>::iterator	responseLru;
+	};
+
+	struct Watch
+	{
+		int		wd;
+		size_t	refs;
+	};
+
+	int m_fd;
+	size_t m_maxEntries;
+	std::unordered_map<std::string, Entry> m_entries;
+	std::list<std::string> m_lru; // most recently used first
+	std::list<std::string> m_missingLru; // same, for the paths that resolved to nothing
+	size_t m_maxResponseBytes;
+	size_t m_responseBytes;
+	std::list<std::string> m_responseLru; // keys of the entries holding responses, most recently used first
+	std::multimap<std::string, std::string> m_dependents; // path → key of an entry that looked at it
+	std::unordered_map<std::string, Watch> m_watches; // directory → its watch
+	std::unordered_map<int, std::string> m_watchDirs;
+
+	bool watch(const std::string &dir);
+	void unwatch(const std::string &dir);
+	void erase(const std::string &key);
+	void dropResponses(Entry &entry);
+	void invalidate(const std::string &path);
+	void clear();
+};
+
+std::string openFileKey(const std::string &docroot, const std::string &index, const std::string &path);
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * RequestFramer → finds where one request ends inside a connection buffer
+ *
+ * feed() is called after every read with the whole buffer and resumes from
+ * where the previous call stopped, so every byte is looked at once: the
+ * head is searched for CRLFCRLF from the last scanned position, the framing
+ * headers are read once, and chunked bodies are walked chunk by chunk
+ * without copying them.
+ *
+ * After COMPLETE, requestLength() bytes at the front of the buffer form the
+ * request; the caller consumes them and calls reset() for the next one.
+ *
+ * Streaming mode: with bodyOut set, the decoded body bytes scanned by this
+ * call are appended to it, so the caller can drop scannedLength() bytes
+ * from the buffer and report it with discard(). Identity body bytes that
+ * never enter the buffer (spliced straight to a CGI script) are reported
+ * with skipBody().
+ */
+
+class RequestFramer
+{
+public:
+	enum Result
+	{
+		INCOMPLETE,
+		COMPLETE,
+		ERROR
+	};
+
+	static const size_t MAX_HEADER_SIZE = 32 * 1024;
+	static const size_t MAX_CHUNK_LINE = 1024;
+
+private:
+	enum State
+	{
+		HEADERS,
+		BODY_IDENTITY,
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_CRLF,
+		TRAILERS,
+		DONE,
+		FAILED
+	};
+
+	State m_state;
+	size_t m_scanPos;
+	size_t m_headerLength;
+	size_t m_contentLength;
+	bool m_chunked;
+	size_t m_chunkRemaining;
+	size_t m_bodyLength;
+	size_t m_maxBodySize;
+	int m_errorStatus;
+
+	Result fail(int status);
+	bool parseFramingHeaders(const std::string &buf);
+	Result scanChunked(const std::string &buf, std::string *bodyOut);
+
+public:
+	RequestFramer();
+	~RequestFramer() = default;
+	RequestFramer(const RequestFramer &other) = default;
+	RequestFramer &operator=(const RequestFramer &other) = default;
+
+	Result feed(const std::string &buf, std::string *bodyOut = NULL);
+	void reset();
+	void rewindBody();
+	void discard(size_t count);
+	void skipBody(size_t count);
+	void setMaxBodySize(size_t maxBodySize);
+
+	bool headersComplete() const;
+	bool isChunked() const;
+	size_t headerLength() const;
+	size_t contentLength() const;
+	size_t requestLength() const;
+	size_t scannedLength() const;
+	size_t bodyRemaining() const;
+	int errorStatus() const;
+};
@@ -4,6 +4,25 @@
 
 class Request;
 
+/**
+ * FileBody → a response body that stays on disk
+ * The open fd is shared by the Response and the output queue that sends it
+ * with sendfile(), and is closed when the last of them lets go.
+ * mtime is the file's modification time when it was opened.
+ */
+struct FileBody
+{
+	int fd;
+	off_t offset;
+	size_t length;
+	time_t mtime = 0;
+
+	FileBody(int fd, off_t offset, size_t length);
+	~FileBody();
+	FileBody(const FileBody &) = delete;
+	FileBody &operator=(const FileBody &) = delete;
+};
+
 class Response
 {
 private:
@@ -12,6 +31,7 @@ private:
 	std::string m_filePath;
 	std::map<std::string, std::string> m_headers;
 	std::string m_body;
+	std::shared_ptr<FileBody> m_fileBody;
 	std::string m_version;
 	std::string m_connection;
 
@@ -27,6 +47,7 @@ public:
 	void setHeader(const std::string &key, const std::string &value);
 	void setFilePath(const std::string &path);
 	void setBody(const std::string &body);
+	void setFileBody(const std::shared_ptr<FileBody> &body);
 	void setMeta(const std::string &version, const std::string &connection);
 
 	// getter
@@ -35,9 +56,12 @@ public:
 	const std::string &getFilePath() const;
 	const std::map<std::string, std::string> &getHeaders(void) const;
 	const std::string &getBody() const;
+	std::string takeBody();
+	const std::shared_ptr<FileBody> &getFileBody() const;
 
 	static const std::string getDefaultMessage(unsigned int statusCode);
 
+	std::string serializeHeaders();
 	std::string serializer();
 	void loadFile();
 	void initialize(unsigned statusCode, const std::string &message, const Request &request);
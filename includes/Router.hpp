@@ -10,22 +10,26 @@ class Router
     std::string m_docroot;
     std::string m_uploads;
     std::string m_index;
-    Server_struct m_serverConfig;
+    // a reference: a copy would read the reloadable error_responses without atomics
+    const Server_struct &m_serverConfig;
+    OpenFileCache *m_openFiles = NULL;
     
     Response handleGET(const std::string& path);
     Response handlePOST(const Request& req);
     Response handleDELETE(const std::string& path);
-    std::string getContentType(const std::filesystem::path& filePath);
 
 	Response generateDirectoryListing(const std::string &fullPath, const std::string &urlPath);
     std::string formatFileSize(std::uintmax_t bytes);
 
     public:
-    Router() = default;
     ~Router() = default;
-    Router(const std::string &docroot, const std::string &uploadsDir, const std::string &index, const Server_struct &serverConfig);
+    Router(const std::string &docroot, const std::string &uploadsDir, const std::string &index, const Server_struct &serverConfig,
+           OpenFileCache *openFiles = NULL);
 
     Response handleRequest(const Request& req);
     Response create405Response();
+    int resolveUploadTarget(const Request& req, std::filesystem::path &target);
+    static Response createdResponse();
+    static std::string getContentType(const std::filesystem::path& filePath);
     bool isMethodAllowed(const std::string& method, const std::string& path);
 };
\ No newline at end of file
@@ -3,25 +3,52 @@
 #include "headers.hpp"
 
 class Request;
+class Response;
 class Server
 {
 private:
-    Config_struct m_config;
-    std::unordered_map<int, int> m_clientOrigin;
-    std::unordered_map<int, std::string> m_inbuf;
-    std::map<int, std::string> m_outbuf;
+    std::shared_ptr<const Config_struct> m_config;
+    int m_workerId;
+    std::vector<Connection> m_connections;
     std::unordered_set<int> m_listenerFdSet;
     std::unordered_map<uint16_t, int> m_portToFd;
     std::unordered_map<int, uint16_t> m_fdToPort;
-    std::vector<struct pollfd> m_fds;
+    std::unique_ptr<EventLoop> m_loop;
     std::unordered_set<uint16_t> m_seen;
+    TimerWheel m_timers;
+    std::vector<int> m_expired;
+    std::string m_uploadChunk;
+    std::unordered_map<int, int> m_cgiFdOwner;
+    std::vector<pid_t> m_cgiZombies;
+    std::vector<int> m_cgiExitPolls;
+    std::unordered_map<const Location_struct *, CgiLimit> m_cgiLimits;
+    size_t m_cgiQueued = 0;
+    std::map<std::string, std::unique_ptr<FastCgiUpstream> > m_fastCgiUpstreams;
+    std::unordered_map<int, FastCgiConnection *> m_fastCgiFds;
+    std::map<std::string, std::unique_ptr<CgiZygote> > m_cgiZygotes;
+    std::unordered_map<int, CgiZygote *> m_cgiZygoteFds;
+    CgiCache m_cgiCache;
+    std::vector<std::unique_ptr<CgiJob> > m_cgiRefreshes;
+    std::unordered_map<std::string, CgiFlight> m_cgiFlights;
+    std::vector<std::pair<int, CgiJob *> > m_cgiRetries;
+    OpenFileCache m_openFiles;
 
-    void closeClientConnection(int client_fd, size_t &index);
+    Connection *findConnection(int fd);
+    void setInterest(Connection &conn, unsigned interest);
+    void closeClientConnection(Connection &conn);
+    void armTimer(Connection &conn, TimerKind kind, int seconds);
+    void armRequestTimer(Connection &conn);
+    void handleExpiredTimers();
+    bool shouldKeepAlive(const Connection &conn, const Request &request, int status);
+    void queueResponse(Connection &conn, Response &res, bool keepAlive);
+    bool queueCachedResponse(Connection &conn, const Request &request, const std::string &fileKey);
+    void queueStaticResponse(Connection &conn, const Request &request, const std::string &fileKey, Response &res);
+    void queuePackResponse(Connection &conn, const Request &request, const std::shared_ptr<const AssetPack> &pack);
     void initializeListeners();
-    void handlePollError(struct pollfd &pfd, size_t &index);
+    void handlePollError(int fd);
     void acceptNewConnections(int listenerFd);
-    void handleClientWrite(struct pollfd &pfd, size_t &index);
-    bool readClientData(int client_fd);
+    void handleClientWrite(Connection &conn);
+    bool readClientData(Connection &conn, bool &peerClosed);
     void setLocationDefaults(const Server_struct &server,
                              const Location_struct *location,
                              std::string &docroot,
@@ -35,23 +62,86 @@ private:
                                 const Location_struct *location,
                                 const std::string &docroot,
                                 const std::string &indexName);
-    bool validateScriptPath(const std::string &scriptPath, const std::string &docroot);
-    void handleCgiRequest(int client_fd,
+    bool validateScriptPath(const std::string &scriptPath, const std::string &docroot, bool needExec = true);
+    void handleCgiRequest(Connection &conn,
                           const Request &request,
                           const std::string &scriptPath,
-                          const std::string &cgiInterpreterPath);
-    void processCompleteRequest(int client_fd, size_t &index);
-    void handleClientRead(struct pollfd &pfd, size_t &index);
+                          const Location_struct &location,
+                          bool bodyFollows = false);
+    bool serveCgiCache(Connection &conn,
+                       const Request &request,
+                       const std::string &scriptPath,
+                       const Location_struct &location,
+                       const std::string &key);
+    void startCgiRefreshes();
+    std::vector<int> takeCgiWaiters(CgiJob &job);
+    void dropCgiFlight(CgiJob &job);
+    void answerCgiWaiters(const std::vector<int> &waiters, const CgiResult &cg);
+    void retryCgiWaiters();
+    void storeCgiResult(const std::string &key, const Location_struct &location, const CgiResult &cg);
+    void startCgiJob(Connection &conn);
+    void releaseCgiSlot(CgiJob &job);
+    void admitCgiQueue(const Location_struct &location, CgiLimit &limit);
+    void admitQueuedCgi();
+    void queueCgiStats(Connection &conn, const Request &request);
+    void armCgiTimer(Connection &conn);
+    bool handleCgiEvent(int fd);
+    void closeCgiFd(int &fd);
+    void writeCgiInput(Connection &conn);
+    bool startCgiBodyStream(Connection &conn);
+    void feedCgiBody(Connection &conn);
+    void readCgiBody(Connection &conn);
+    void updateCgiInterest(Connection &conn);
+    void readCgiOutput(Connection &conn);
+    void relayCgiOutput(Connection &conn);
+    void queueCgiStreamHead(Connection &conn, const std::string &head);
+    void resumeCgiOutput(Connection &conn);
+    void reapCgi(Connection &conn);
+    void releaseCgi(Connection &conn);
+    void reapCgiZombies();
+    void pollCgiExits();
+    void queueCgiResponse(Connection &conn, const Request &request, const CgiResult &cg, const char *cacheState = NULL);
+    void resumeAfterCgi(Connection &conn);
+    void finishCgi(Connection &conn);
+    void finishCgiStream(Connection &conn);
+    void abortCgi(Connection &conn, int status, const std::string &body);
+    void handleCgiTimeout(Connection &conn);
+    void cancelCgi(Connection &conn);
+    CgiZygote *cgiZygote(const std::string &interpreter);
+    void detachZygoteChild(CgiJob &job);
+    void signalZygoteChild(pid_t pid, int pidFd, int sig);
+    bool handleCgiZygoteEvent(int fd);
+    void handleCgiZygoteMessage(CgiZygote &zygote, const char *msg, int pidFd);
+    void closeCgiZygote(CgiZygote &zygote);
+    void startFastCgiJob(Connection &conn, const Location_struct &location);
+    FastCgiConnection *openFastCgiConnection(FastCgiUpstream &pool);
+    void dispatchFastCgi(FastCgiUpstream &pool);
+    void failFastCgiJob(CgiJob *job, int status);
+    void detachFastCgiJob(CgiJob &job);
+    bool handleFastCgiEvent(int fd, unsigned events);
+    bool flushFastCgi(FastCgiConnection &fc);
+    bool readFastCgi(FastCgiConnection &fc);
+    void handleFastCgiRecord(FastCgiConnection &fc, unsigned char type, uint16_t id, const char *data, size_t len);
+    void completeFastCgiJob(CgiJob &job, const char *data, size_t len);
+    void armFastCgiAbortTimer(FastCgiConnection &fc);
+    void closeFastCgiConnection(FastCgiConnection &fc);
+    bool startUploadStream(Connection &conn);
+    bool continueUploadStream(Connection &conn);
+    void processBufferedRequests(Connection &conn);
+    void processCompleteRequest(Connection &conn, size_t requestLength);
+    void handleClientRead(Connection &conn);
+    void runEventLoop(void);
 
 public:
     Server();
     ~Server() = default;
-    Server(const Server &other) = default;
-    Server &operator=(const Server &other) = default;
+    Server(const Server &other) = delete;
+    Server &operator=(const Server &other) = delete;
 
     Server(const Config_struct &cfg);
+    Server(std::shared_ptr<const Config_struct> cfg, int workerId);
 
     int start_server(void);
     std::string readFile(const std::string &filename);
-    void sendError(int client_fd, int code, const Server_struct &server);
+    void sendError(int client_fd, int code, const Server_struct &server, bool keepAlive = false);
 };
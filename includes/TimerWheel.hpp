@@ -0,0 +1,57 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * TimerWheel → hierarchical timing wheel, one pending deadline per id (the client fd)
+ * tickMs → resolution of a level 0 slot
+ * LEVELS x SLOTS → 4 x 64 slots, about 19 days of range at 100 ms per tick
+ *
+ * schedule/cancel are O(1); advance() touches only the slots that became due,
+ * cascading far timers down one level at a time like the Linux kernel wheel.
+ */
+
+class TimerWheel
+{
+private:
+	static const int LEVELS = 4;
+	static const int SLOT_BITS = 6;
+	static const int SLOTS = 1 << SLOT_BITS;
+	static const uint64_t SLOT_MASK = SLOTS - 1;
+
+	struct Node
+	{
+		uint64_t expires;
+		int prev;
+		int next;
+		int level;
+		int slot;
+		bool active;
+	};
+
+	unsigned m_tickMs;
+	uint64_t m_now;
+	size_t m_count;
+	std::vector<Node> m_nodes;
+	int m_heads[LEVELS][SLOTS];
+
+	void link(int id);
+	void unlink(int id);
+	void cascade(int level, int slot);
+
+public:
+	TimerWheel(unsigned tickMs = 100);
+	~TimerWheel() = default;
+	TimerWheel(const TimerWheel &other) = default;
+	TimerWheel &operator=(const TimerWheel &other) = default;
+
+	void schedule(int id, uint64_t deadlineMs);
+	void cancel(int id);
+	bool isScheduled(int id) const;
+	size_t size() const;
+
+	void advance(uint64_t nowMs, std::vector<int> &expired);
+	int nextTimeoutMs(uint64_t nowMs) const;
+
+	static uint64_t monotonicMs();
+};
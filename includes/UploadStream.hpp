@@ -0,0 +1,50 @@
+#pragma once
+
+#include "headers.hpp"
+
+/**
+ * UploadStream → writes a request body to disk while it is still arriving
+ *
+ * open() creates a hidden temp file next to the final target; write() takes
+ * decoded body bytes (chunked framing already removed) and, for
+ * multipart/form-data, keeps only the content of the first part exactly
+ * like RequestParser's bodyContentExtractor; commit() links the temp file
+ * to its final name (failing if it already exists) and removes the temp.
+ * Anything not committed is unlinked by abort() / the destructor.
+ */
+
+class UploadStream
+{
+public:
+	static const size_t MAX_PART_HEADER = 16 * 1024;
+
+private:
+	enum MultipartState
+	{
+		PART_NONE,
+		PART_HEADERS,
+		PART_DATA,
+		PART_DONE
+	};
+
+	int m_fd;
+	std::string m_tempPath;
+	std::string m_finalPath;
+	std::string m_delimiter;
+	std::string m_pending;
+	MultipartState m_partState;
+	bool m_failed;
+
+	bool writeAll(const char *data, size_t len);
+
+public:
+	UploadStream();
+	~UploadStream();
+	UploadStream(const UploadStream &other) = delete;
+	UploadStream &operator=(const UploadStream &other) = delete;
+
+	bool open(const std::string &finalPath, const std::string &boundary);
+	bool write(const char *data, size_t len);
+	int commit();
+	void abort();
+};
@@ -13,6 +13,9 @@
 #include <sstream>
 #include <vector>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <memory>
+#include <thread>
 #include <map>
 #include <cstring>
 #include <algorithm>  // parser
@@ -37,20 +40,42 @@
 #include <cstring>
 #include <cctype>
 #include <netinet/in.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <spawn.h>
+#include <arpa/inet.h>
+#include <deque>
+#include <mutex>
+#include <list>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 
 
 
 
 
 #include "ConfigStructs.hpp"
-#include "Server.hpp"
-#include "Response.hpp"
+#include "EventLoop.hpp"
+#include "TimerWheel.hpp"
+#include "RequestFramer.hpp"
 #include "Request.hpp"
+#include "Response.hpp"
+#include "ErrorPages.hpp"
+#include "AssetPack.hpp"
+#include "OpenFileCache.hpp"
+#include "UploadStream.hpp"
+#include "Cgi.hpp"
+#include "Connection.hpp"
+#include "FastCgi.hpp"
+#include "CgiZygote.hpp"
+#include "CgiCache.hpp"
+#include "Server.hpp"
 #include "RequestParser.hpp"
 #include "utils.hpp"
 #include "Router.hpp"
 #include "Config.hpp"
 #include "ConfigParser.hpp"
 #include "ConfigCheck.hpp"
-#include "Cgi.hpp"
 #include "http_utils.hpp"
@@ -5,7 +5,9 @@ inline const char* reasonPhrase(int code) {
         case 200: return "OK";
         case 201: return "Created";
         case 204: return "No Content";
+        case 301: return "Moved Permanently";
         case 302: return "Found";
+        case 304: return "Not Modified";
         case 400: return "Bad Request";
         case 403: return "Forbidden";
         case 404: return "Not Found";
@@ -13,6 +15,8 @@ inline const char* reasonPhrase(int code) {
         case 413: return "Payload Too Large";
         case 500: return "Internal Server Error";
         case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
         case 504: return "Gateway Timeout";
         default:  return "OK";
     }
@@ -32,6 +32,8 @@ int main(int argc, char **argv)
 
 		// final check of the config struct
 		configFinalCheck(config);
+		loadErrorPages(config);
+		loadAssetPacks(config);
 
 		Server server(config);
 
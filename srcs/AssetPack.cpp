@@ -0,0 +1,379 @@
+#include "headers.hpp"
+
+// FNV-1a: the pack is built once and probed per request, any cheap hash with few collisions fits
+uint64_t packHash(const char *data, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t alignUp(uint64_t offset)
+{
+	return (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+AssetPack::AssetPack() : m_base(NULL), m_size(0), m_header(NULL)
+{
+}
+
+AssetPack::~AssetPack()
+{
+	if (m_base)
+		::munmap(const_cast<char *>(m_base), m_size);
+}
+
+std::shared_ptr<const AssetPack> AssetPack::open(const std::string &path, std::string &error)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		error = path + ": " + std::strerror(errno);
+		return std::shared_ptr<const AssetPack>();
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(PackHeader))
+	{
+		error = path + ": not a pack file";
+		::close(fd);
+		return std::shared_ptr<const AssetPack>();
+	}
+
+	void *base = ::mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (base == MAP_FAILED)
+	{
+		error = path + ": " + std::strerror(errno);
+		return std::shared_ptr<const AssetPack>();
+	}
+	// the whole site is answered from here: page it in now rather than on the first requests
+	::madvise(base, static_cast<size_t>(st.st_size), MADV_WILLNEED);
+
+	std::shared_ptr<AssetPack> pack(new AssetPack());
+	pack->m_base = static_cast<const char *>(base);
+	pack->m_size = static_cast<size_t>(st.st_size);
+	pack->m_header = reinterpret_cast<const PackHeader *>(base);
+	if (!pack->validate(error))
+	{
+		error = path + ": " + error;
+		return std::shared_ptr<const AssetPack>();
+	}
+	return pack;
+}
+
+bool AssetPack::inBounds(uint64_t offset, uint64_t length) const
+{
+	return offset <= m_size && length <= m_size - offset;
+}
+
+bool AssetPack::validate(std::string &error) const
+{
+	const PackHeader &header = *m_header;
+	if (std::memcmp(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0)
+		error = "not a pack file";
+	else if (header.version != PACK_VERSION)
+		error = "pack version " + std::to_string(header.version) + " is not supported";
+	else if (header.fileSize != m_size)
+		error = "truncated pack file";
+	else if (!header.bucketCount || (header.bucketCount & (header.bucketCount - 1))
+			 || header.bucketsOffset % alignof(PackBucket) || header.assetsOffset % alignof(PackAsset)
+			 || !inBounds(header.bucketsOffset, static_cast<uint64_t>(header.bucketCount) * sizeof(PackBucket))
+			 || !inBounds(header.assetsOffset, static_cast<uint64_t>(header.assetCount) * sizeof(PackAsset)))
+		error = "corrupt pack index";
+	if (!error.empty())
+		return false;
+
+	const PackBucket *buckets = reinterpret_cast<const PackBucket *>(m_base + header.bucketsOffset);
+	const PackAsset *assets = reinterpret_cast<const PackAsset *>(m_base + header.assetsOffset);
+	// a table without a free bucket would make a miss probe forever
+	bool hasFree = false;
+	for (uint32_t i = 0; i < header.bucketCount; ++i)
+	{
+		if (!buckets[i].asset)
+		{
+			hasFree = true;
+			continue;
+		}
+		if (buckets[i].asset > header.assetCount || !inBounds(buckets[i].pathOffset, buckets[i].pathLength))
+		{
+			error = "corrupt pack index";
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header.assetCount; ++i)
+	{
+		const PackAsset &asset = assets[i];
+		if (!inBounds(asset.dataOffset, asset.dataLength) || !inBounds(asset.gzipOffset, asset.gzipLength)
+			|| !inBounds(asset.typeOffset, asset.typeLength) || !inBounds(asset.etagOffset, asset.etagLength)
+			|| !inBounds(asset.gzipEtagOffset, asset.gzipEtagLength))
+		{
+			error = "corrupt pack asset";
+			return false;
+		}
+	}
+	if (!hasFree)
+		error = "corrupt pack index";
+	return hasFree;
+}
+
+bool AssetPack::find(const std::string &path, Asset &asset) const
+{
+	const PackBucket *buckets = reinterpret_cast<const PackBucket *>(m_base + m_header->bucketsOffset);
+	uint64_t hash = packHash(path.data(), path.size());
+	uint32_t mask = m_header->bucketCount - 1;
+
+	for (uint32_t slot = static_cast<uint32_t>(hash) & mask;; slot = (slot + 1) & mask)
+	{
+		const PackBucket &bucket = buckets[slot];
+		if (!bucket.asset)
+			return false;
+		if (bucket.hash != hash || bucket.pathLength != path.size()
+			|| std::memcmp(m_base + bucket.pathOffset, path.data(), path.size()) != 0)
+			continue;
+
+		const PackAsset &found = reinterpret_cast<const PackAsset *>(m_base + m_header->assetsOffset)[bucket.asset - 1];
+		asset.data = m_base + found.dataOffset;
+		asset.length = found.dataLength;
+		asset.gzip = found.gzipLength ? m_base + found.gzipOffset : NULL;
+		asset.gzipLength = found.gzipLength;
+		asset.contentType.assign(m_base + found.typeOffset, found.typeLength);
+		asset.etag.assign(m_base + found.etagOffset, found.etagLength);
+		asset.gzipEtag.assign(m_base + found.gzipEtagOffset, found.gzipEtagLength);
+		return true;
+	}
+}
+
+static bool readWholeFile(const std::filesystem::path &path, std::string &out)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	out = buffer.str();
+	return !file.bad();
+}
+
+static std::string formatEtag(uint64_t hash)
+{
+	char buffer[32];
+	std::snprintf(buffer, sizeof(buffer), "\"%016llx\"", static_cast<unsigned long long>(hash));
+	return buffer;
+}
+
+static bool endsWith(const std::string &s, const std::string &suffix)
+{
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * Every URL path Router::handleGET would answer with a file of docroot:
+ * the file's own path, a directory (with and without its trailing slash)
+ * holding index, and a path whose ".html" file exists when nothing else
+ * does. Directories without index are listed by the router, not packed.
+ */
+static void collectRoutes(const std::filesystem::path &root, const std::string &index,
+						  const std::vector<std::string> &urls, std::map<std::string, uint32_t> &routes)
+{
+	for (size_t i = 0; i < urls.size(); ++i)
+		routes[urls[i]] = static_cast<uint32_t>(i);
+
+	for (size_t i = 0; i < urls.size(); ++i)
+	{
+		if (!endsWith(urls[i], "/" + index))
+			continue;
+		std::string dir = urls[i].substr(0, urls[i].size() - index.size() - 1);
+		routes.insert(std::make_pair(dir.empty() ? "/" : dir, static_cast<uint32_t>(i)));
+		routes.insert(std::make_pair(dir + "/", static_cast<uint32_t>(i)));
+	}
+
+	for (size_t i = 0; i < urls.size(); ++i)
+	{
+		if (!endsWith(urls[i], ".html"))
+			continue;
+		std::string bare = urls[i].substr(0, urls[i].size() - 5);
+		std::error_code ec;
+		if (!bare.empty() && bare != "/" && !std::filesystem::exists(root / bare.substr(1), ec))
+			routes.insert(std::make_pair(bare, static_cast<uint32_t>(i)));
+	}
+}
+
+/**
+ * Writes the pack of docroot to output (see AssetPack.hpp for the layout).
+ * A "name.gz" next to "name" becomes its precompressed variant, and stays
+ * a file of its own as well, whose ETag the variant reuses. The pack is
+ * written under a temporary name and renamed over output, so a server
+ * still mapping the old one keeps reading consistent data.
+ */
+bool writeAssetPack(const std::string &docroot, const std::string &index, const std::string &output,
+					size_t &assets, std::string &error)
+{
+	std::error_code ec;
+	std::filesystem::path root = std::filesystem::canonical(docroot, ec);
+	if (ec || !std::filesystem::is_directory(root, ec))
+	{
+		error = docroot + ": not a directory";
+		return false;
+	}
+
+	std::vector<std::filesystem::path> files;
+	for (std::filesystem::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec))
+	{
+		if (it->is_regular_file(ec))
+			files.push_back(it->path());
+	}
+	if (ec)
+	{
+		error = docroot + ": " + ec.message();
+		return false;
+	}
+	std::sort(files.begin(), files.end());
+
+	std::vector<std::string> urls(files.size());
+	std::map<std::string, uint32_t> routes;
+	for (size_t i = 0; i < files.size(); ++i)
+		urls[i] = "/" + files[i].lexically_relative(root).generic_string();
+	collectRoutes(root, index, urls, routes);
+
+	PackHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+	header.version = PACK_VERSION;
+	header.bucketCount = 8;
+	while (header.bucketCount < routes.size() * 2)
+		header.bucketCount <<= 1;
+	header.assetCount = static_cast<uint32_t>(files.size());
+	header.bucketsOffset = sizeof(PackHeader);
+	header.assetsOffset = header.bucketsOffset + header.bucketCount * sizeof(PackBucket);
+
+	std::vector<PackBucket> buckets(header.bucketCount);
+	std::vector<PackAsset> records(files.size());
+	std::memset(buckets.data(), 0, buckets.size() * sizeof(PackBucket));
+	std::memset(records.data(), 0, records.size() * sizeof(PackAsset));
+	uint64_t stringsOffset = header.assetsOffset + records.size() * sizeof(PackAsset);
+	std::string strings;
+
+	uint32_t mask = header.bucketCount - 1;
+	for (std::map<std::string, uint32_t>::iterator it = routes.begin(); it != routes.end(); ++it)
+	{
+		uint64_t hash = packHash(it->first.data(), it->first.size());
+		uint32_t slot = static_cast<uint32_t>(hash) & mask;
+		while (buckets[slot].asset)
+			slot = (slot + 1) & mask;
+		buckets[slot].hash = hash;
+		buckets[slot].pathOffset = stringsOffset + strings.size();
+		buckets[slot].pathLength = static_cast<uint32_t>(it->first.size());
+		buckets[slot].asset = it->second + 1;
+		strings += it->first;
+	}
+
+	// ETags are only known once the data is read, their room is kept here
+	const size_t etagLength = formatEtag(0).size();
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		std::string type = Router::getContentType(files[i]);
+		records[i].typeOffset = stringsOffset + strings.size();
+		records[i].typeLength = static_cast<uint32_t>(type.size());
+		strings += type;
+		records[i].etagOffset = stringsOffset + strings.size();
+		records[i].etagLength = static_cast<uint32_t>(etagLength);
+		strings.append(etagLength, '\0');
+	}
+
+	std::string temporary = output + ".tmp";
+	std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+	{
+		error = temporary + ": " + std::strerror(errno);
+		return false;
+	}
+
+	uint64_t offset = alignUp(stringsOffset + strings.size());
+	out.seekp(static_cast<std::streamoff>(offset));
+	for (size_t i = 0; i < files.size() && out; ++i)
+	{
+		std::string content;
+		if (!readWholeFile(files[i], content))
+		{
+			error = files[i].string() + ": cannot be read";
+			out.close();
+			std::remove(temporary.c_str());
+			return false;
+		}
+		records[i].dataOffset = offset;
+		records[i].dataLength = content.size();
+		std::string etag = formatEtag(packHash(content.data(), content.size()));
+		strings.replace(records[i].etagOffset - stringsOffset, etagLength, etag);
+
+		out.write(content.data(), static_cast<std::streamsize>(content.size()));
+		uint64_t next = alignUp(offset + content.size());
+		out.write(std::string(next - offset - content.size(), '\0').data(),
+				  static_cast<std::streamsize>(next - offset - content.size()));
+		offset = next;
+	}
+	header.fileSize = offset;
+
+	for (size_t i = 0; i < urls.size(); ++i)
+	{
+		std::map<std::string, uint32_t>::iterator base;
+		if (!endsWith(urls[i], ".gz") || (base = routes.find(urls[i].substr(0, urls[i].size() - 3))) == routes.end()
+			|| urls[base->second] != base->first)
+			continue;
+		records[base->second].gzipOffset = records[i].dataOffset;
+		records[base->second].gzipLength = records[i].dataLength;
+		records[base->second].gzipEtagOffset = records[i].etagOffset;
+		records[base->second].gzipEtagLength = records[i].etagLength;
+	}
+
+	out.seekp(0);
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char *>(buckets.data()), static_cast<std::streamsize>(buckets.size() * sizeof(PackBucket)));
+	out.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(PackAsset)));
+	out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+	out.close();
+	if (!out || std::rename(temporary.c_str(), output.c_str()) != 0)
+	{
+		error = output + ": " + std::strerror(errno);
+		std::remove(temporary.c_str());
+		return false;
+	}
+	assets = files.size();
+	return true;
+}
+
+static std::shared_ptr<const AssetPack> loadAssetPack(const std::string &path,
+													  std::map<std::string, std::shared_ptr<const AssetPack> > &opened)
+{
+	std::map<std::string, std::shared_ptr<const AssetPack> >::iterator it = opened.find(path);
+	if (it != opened.end())
+		return it->second;
+
+	std::string error;
+	std::shared_ptr<const AssetPack> pack = AssetPack::open(path, error);
+	if (!pack)
+		throw std::runtime_error("root_pack " + error);
+	opened[path] = pack;
+	return pack;
+}
+
+// at startup, before the workers share the config; a pack named twice is mapped once
+void loadAssetPacks(Config_struct &config)
+{
+	std::map<std::string, std::shared_ptr<const AssetPack> > opened;
+	for (size_t i = 0; i < config.servers.size(); ++i)
+	{
+		Server_struct &server = config.servers[i];
+		if (!server.root_pack.empty())
+			server.pack = loadAssetPack(server.root_pack, opened);
+		for (size_t j = 0; j < server.locations.size(); ++j)
+		{
+			if (!server.locations[j].root_pack.empty())
+				server.locations[j].pack = loadAssetPack(server.locations[j].root_pack, opened);
+		}
+	}
+}
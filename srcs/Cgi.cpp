@@ -1,147 +1,219 @@
 #include "headers.hpp"
 
 
-static void setenv_str(const char* k, const std::string& v) {
-    setenv(k, v.c_str(), 1);
-}
-// Helper: read with timeout
-static bool readWithTimeout(int fd, std::string &out, int timeoutSec) {
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    struct timeval tv;
-    tv.tv_sec = timeoutSec;
-    tv.tv_usec = 0;
-
-    char buf[4096];
-    while (true) {
-        fd_set rfds = fds;
-        int ret = select(fd + 1, &rfds, NULL, NULL, &tv);
-        if (ret == 0) return false;  // timeout
-        if (ret < 0) {
-            if (errno == EINTR) continue;
-            return false;
-        }
-
-        if (FD_ISSET(fd, &rfds)) {
-            ssize_t n = read(fd, buf, sizeof(buf));
-            if (n <= 0) break;
-            out.append(buf, n);
-        } else {
-            break;
-        }
+static std::string addressToString(const struct sockaddr_storage& addr, std::string& port) {
+    char host[INET6_ADDRSTRLEN] = "";
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in* in = reinterpret_cast<const struct sockaddr_in*>(&addr);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        port = std::to_string(ntohs(in->sin_port));
+    } else if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = reinterpret_cast<const struct sockaddr_in6*>(&addr);
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        port = std::to_string(ntohs(in6->sin6_port));
     }
-    return true;
+    return host;
 }
 
-CgiResult runCgi(const Request& req,
-                 const std::string& scriptPath,
-                 const std::string& interpreter) {
-    CgiResult r;
+/**
+ * The RFC 3875 meta-variables of a request, shared by spawned scripts
+ * (environment) and FastCGI (PARAMS). Every request header becomes an
+ * HTTP_* variable except the two already passed as CONTENT_* and Proxy
+ * (a client must not be able to set HTTP_PROXY for the script).
+ */
+CgiParams buildCgiParams(const Request& req, const std::string& scriptPath, int clientFd) {
+    std::string scriptName = req.getPath().substr(0, req.getPath().find('?'));
 
-    int inPipe[2];
-    int outPipe[2];
-    if (pipe(inPipe) < 0 || pipe(outPipe) < 0) {
-        r.status = 500; r.body = "pipe() failed\n";
-        return r;
-    }
+    struct sockaddr_storage peer;
+    struct sockaddr_storage local;
+    socklen_t peerLen = sizeof(peer);
+    socklen_t localLen = sizeof(local);
+    std::string remoteAddr, remotePort, serverAddr, serverPort;
+    if (getpeername(clientFd, reinterpret_cast<struct sockaddr*>(&peer), &peerLen) == 0)
+        remoteAddr = addressToString(peer, remotePort);
+    if (getsockname(clientFd, reinterpret_cast<struct sockaddr*>(&local), &localLen) == 0)
+        serverAddr = addressToString(local, serverPort);
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        r.status = 500; r.body = "fork() failed\n";
-        return r;
-    }
+    std::string serverName = req.getHost();
+    if (serverName.empty())
+        serverName = serverAddr;
+    else if (serverName[0] != '[' && serverName.find(':') != std::string::npos)
+        serverName.erase(serverName.find(':'));
 
-    if (pid == 0) {
-        dup2(inPipe[0], STDIN_FILENO);
-        dup2(outPipe[1], STDOUT_FILENO);
+    CgiParams params;
+    params.push_back(std::make_pair("GATEWAY_INTERFACE", "CGI/1.1"));
+    params.push_back(std::make_pair("SERVER_SOFTWARE", "webserv"));
+    params.push_back(std::make_pair("SERVER_PROTOCOL", req.getVersion().empty() ? "HTTP/1.1" : req.getVersion()));
+    params.push_back(std::make_pair("SERVER_NAME", serverName));
+    params.push_back(std::make_pair("SERVER_PORT", serverPort));
+    params.push_back(std::make_pair("REQUEST_METHOD", req.getMethod()));
+    params.push_back(std::make_pair("REQUEST_URI", req.getPath()));
+    params.push_back(std::make_pair("SCRIPT_NAME", scriptName));
+    params.push_back(std::make_pair("SCRIPT_FILENAME", scriptPath));
+    params.push_back(std::make_pair("PATH_INFO", ""));
+    params.push_back(std::make_pair("QUERY_STRING", req.getQuery()));
+    params.push_back(std::make_pair("REMOTE_ADDR", remoteAddr));
+    params.push_back(std::make_pair("REMOTE_PORT", remotePort));
+    params.push_back(std::make_pair("AUTH_TYPE", ""));
+    params.push_back(std::make_pair("CONTENT_TYPE", req.getHeader("Content-Type")));
+    params.push_back(std::make_pair("CONTENT_LENGTH", req.getHeader("Content-Length")));
+    // php-cgi refuses to run without it when built with force-cgi-redirect
+    params.push_back(std::make_pair("REDIRECT_STATUS", "200"));
 
-        close(inPipe[0]);
-        close(inPipe[1]);
-        close(outPipe[0]);
-        close(outPipe[1]);
-
-        setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
-        setenv_str("REQUEST_METHOD", req.getMethod());
-        setenv_str("SCRIPT_FILENAME", scriptPath);
-        setenv_str("QUERY_STRING", req.getQuery());
-        setenv_str("CONTENT_TYPE", req.getHeader("Content-Type"));
-        setenv_str("CONTENT_LENGTH", req.getHeader("Content-Length"));
-        setenv("SERVER_PROTOCOL", "HTTP/1.1", 1);
-        setenv_str("HTTP_HOST", req.getHost());
-
-        std::vector<char*> argv;
-        if (!interpreter.empty()) {
-            argv.push_back(const_cast<char*>(interpreter.c_str()));
-            argv.push_back(const_cast<char*>(scriptPath.c_str()));
-        } else {
-            argv.push_back(const_cast<char*>(scriptPath.c_str()));
-        }
-        argv.push_back(nullptr);
-
-        execvp(argv[0], argv.data());
-        const char* msg = "execvp failed\n";
-        write(STDOUT_FILENO, msg, strlen(msg));
-        _exit(127);
+    const std::map<std::string, std::string>& headers = req.getHeaders();
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it) {
+        std::string name = stringToUpper(it->first);
+        if (name == "CONTENT-TYPE" || name == "CONTENT-LENGTH" || name == "PROXY")
+            continue;
+        std::replace(name.begin(), name.end(), '-', '_');
+        params.push_back(std::make_pair("HTTP_" + name, it->second));
     }
+    return params;
+}
 
-    // === Parent process ===
-    close(inPipe[0]);
-    close(outPipe[1]);
-
-    // Send POST body if any
-    const std::string& body = req.getBody();
-    if (!body.empty())
-        write(inPipe[1], body.c_str(), body.size());
-    close(inPipe[1]);
+// the counters outlive the workers, so a location keeps one entry for the whole process
+CgiLocationStats& cgiLocationStats(const Location_struct* location) {
+    static std::mutex mutex;
+    static std::map<const Location_struct*, std::unique_ptr<CgiLocationStats> > stats;
 
-    std::string out;
-bool ok = readWithTimeout(outPipe[0], out, 3);  // 3s timeout
-close(outPipe[0]);
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<CgiLocationStats>& entry = stats[location];
+    if (!entry)
+        entry.reset(new CgiLocationStats());
+    return *entry;
+}
 
-int status = 0;
-waitpid(pid, &status, 0);
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
 
-if (!ok) {
-    kill(pid, SIGKILL);
-    waitpid(pid, NULL, 0);
-    r.status = 504;
-    r.body = "<h1>504 Gateway Timeout (CGI read timeout)</h1>";
-    return r;
+static void closePipe(int p[2]) {
+    close(p[0]);
+    close(p[1]);
 }
 
-if (WIFSIGNALED(status)) {
-    r.status = 502;
-    r.body = "<h1>502 Bad Gateway (CGI killed by signal)</h1>";
-    return r;
+// "NAME=value" strings for an exec'd script's environment
+std::vector<std::string> buildCgiEnvironment(const CgiParams& params) {
+    std::vector<std::string> env;
+    env.reserve(params.size() + 1);
+    for (size_t i = 0; i < params.size(); ++i)
+        env.push_back(params[i].first + "=" + params[i].second);
+    // scripts started through "#!/usr/bin/env python3" still need a search path
+    const char* path = getenv("PATH");
+    env.push_back(std::string("PATH=") + (path ? path : "/usr/local/bin:/usr/bin:/bin"));
+    return env;
 }
 
-if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-    r.status = 500;
-    r.body = "<h1>500 Internal Server Error (CGI failed)</h1>";
-    return r;
+// stdin/stdout pipes for a script; only the parent's ends are non-blocking,
+// the script gets ordinary blocking stdio
+bool openCgiPipes(int inPipe[2], int outPipe[2]) {
+    if (pipe2(inPipe, O_CLOEXEC) < 0)
+        return false;
+    if (pipe2(outPipe, O_CLOEXEC) < 0) {
+        closePipe(inPipe);
+        return false;
+    }
+    if (!setNonBlocking(inPipe[1]) || !setNonBlocking(outPipe[0])) {
+        closePipe(inPipe);
+        closePipe(outPipe);
+        return false;
+    }
+    return true;
 }
 
+/**
+ * Starts the script and hands back the parent's pipe ends; the event loop
+ * does the I/O. posix_spawn (clone+exec sharing the parent's memory until
+ * exec on glibc) keeps the launch cost independent of the server's size,
+ * where fork() had to copy the page tables of every buffer and cache. The
+ * environment is built here, the child only runs exec.
+ */
+bool spawnCgi(const CgiParams& params,
+              const std::string& scriptPath,
+              const std::string& interpreter,
+              CgiProcess& proc) {
+    std::vector<std::string> env = buildCgiEnvironment(params);
+    std::vector<char*> envp;
+    envp.reserve(env.size() + 1);
+    for (size_t i = 0; i < env.size(); ++i)
+        envp.push_back(const_cast<char*>(env[i].c_str()));
+    envp.push_back(nullptr);
 
-    // === Normal output parsing ===
-    size_t sep = out.find("\r\n\r\n");
-    if (sep == std::string::npos)
-        sep = out.find("\n\n");
+    std::vector<char*> argv;
+    if (!interpreter.empty())
+        argv.push_back(const_cast<char*>(interpreter.c_str()));
+    argv.push_back(const_cast<char*>(scriptPath.c_str()));
+    argv.push_back(nullptr);
 
-    std::string head = "";
-    std::string bodyOut = out;
+    int inPipe[2];
+    int outPipe[2];
+    if (!openCgiPipes(inPipe, outPipe))
+        return false;
+
+    // dup2 onto stdin/stdout clears O_CLOEXEC there; every other pipe end closes on exec
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, inPipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+
+    // own process group so the whole script can be signalled at once; the
+    // server ignores SIGPIPE, which exec would otherwise pass on to the script
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    sigset_t mask;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
 
-    if (sep != std::string::npos) {
-        head = out.substr(0, sep);
-        bodyOut = out.substr(sep + ((out.find("\r\n\r\n") != std::string::npos) ? 4 : 2));
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(), envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    close(inPipe[0]);
+    close(outPipe[1]);
+    if (err != 0) {
+        close(inPipe[1]);
+        close(outPipe[0]);
+        errno = err;
+        return false;
     }
 
-    int httpStatus = 200;
-    std::map<std::string, std::string> headers;
+    proc.pid = pid;
+    proc.stdinFd = inPipe[1];
+    proc.stdoutFd = outPipe[0];
+    // a pidfd turns the child's exit into an ordinary readable fd for the event loop
+    proc.pidFd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    return true;
+}
+
+/**
+ * Where the header block of a script's output ends (the blank line), or
+ * npos while it is incomplete; bodyStart is set past the blank line.
+ */
+size_t findCgiHeaderEnd(const std::string& out, size_t& bodyStart) {
+    size_t crlf = out.find("\r\n\r\n");
+    size_t lf = out.find("\n\n");
+
+    if (crlf != std::string::npos && (lf == std::string::npos || crlf < lf)) {
+        bodyStart = crlf + 4;
+        return crlf;
+    }
+    if (lf != std::string::npos)
+        bodyStart = lf + 2;
+    return lf;
+}
 
+void parseCgiHeaders(const std::string& head, CgiResult& r) {
     std::istringstream iss(head);
     std::string line;
+    bool hasStatus = false;
     while (std::getline(iss, line)) {
         if (!line.empty() && line.back() == '\r')
             line.pop_back();
@@ -151,8 +223,10 @@ if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
         if (col == std::string::npos) {
             if (line.rfind("Status", 0) == 0) {
                 size_t sp = line.find(' ');
-                if (sp != std::string::npos)
-                    httpStatus = std::atoi(line.c_str() + sp + 1);
+                if (sp != std::string::npos) {
+                    r.status = std::atoi(line.c_str() + sp + 1);
+                    hasStatus = true;
+                }
             }
             continue;
         }
@@ -163,11 +237,45 @@ if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
         while (!val.empty() && (val.front() == ' ' || val.front() == '\t'))
             val.erase(0, 1);
 
-        headers[key] = val;
+        // "Status: 404 Not Found" sets the status line, it is not sent as a header
+        if (key == "status") {
+            r.status = std::atoi(val.c_str());
+            hasStatus = true;
+            continue;
+        }
+        r.headers[key] = val;
+    }
+    // a Location without a Status is a redirect (RFC 3875 6.2.3)
+    if (!hasStatus && r.headers.count("location"))
+        r.status = 302;
+}
+
+// Turns what the script wrote and how it exited into a status, headers and body
+CgiResult parseCgiOutput(const std::string& out, int status) {
+    CgiResult r;
+
+if (WIFSIGNALED(status)) {
+    r.status = 502;
+    r.body = "<h1>502 Bad Gateway (CGI killed by signal)</h1>";
+    return r;
+}
+
+if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+    r.status = 500;
+    r.body = "<h1>500 Internal Server Error (CGI failed)</h1>";
+    return r;
+}
+
+
+    // === Normal output parsing ===
+    size_t bodyStart = 0;
+    size_t sep = findCgiHeaderEnd(out, bodyStart);
+    if (sep == std::string::npos) {
+        r.body = out;
+        return r;
     }
 
-    r.status = httpStatus;
-    r.headers = headers;
-    r.body = bodyOut;
+    parseCgiHeaders(out.substr(0, sep), r);
+    r.body = out.substr(bodyStart);
     return r;
 }
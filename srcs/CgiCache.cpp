@@ -0,0 +1,174 @@
+#include "headers.hpp"
+
+CgiCache::CgiCache(size_t maxBytes) : m_bytes(0), m_maxBytes(maxBytes)
+{
+}
+
+size_t CgiCache::entrySize(const std::string &key, const CgiCacheEntry &entry)
+{
+	size_t size = key.size() + entry.body.size();
+	for (const auto &kv : entry.headers)
+		size += kv.first.size() + kv.second.size();
+	return size;
+}
+
+// an entry past its stale window is dropped here, so the caller runs the script
+CgiCache::State CgiCache::lookup(const std::string &key, time_t now, CgiCacheEntry *&entry)
+{
+	std::unordered_map<std::string, Entries::iterator>::iterator it = m_index.find(key);
+	if (it == m_index.end())
+		return MISS;
+
+	Entries::iterator slot = it->second;
+	if (now >= slot->second.staleUntil)
+	{
+		erase(key);
+		return MISS;
+	}
+	m_entries.splice(m_entries.begin(), m_entries, slot);
+	entry = &slot->second;
+	return now < slot->second.freshUntil ? FRESH : STALE;
+}
+
+CgiCacheEntry *CgiCache::find(const std::string &key)
+{
+	std::unordered_map<std::string, Entries::iterator>::iterator it = m_index.find(key);
+	return it == m_index.end() ? NULL : &it->second->second;
+}
+
+// replaces whatever was cached for key; an answer larger than the whole cache is not kept
+void CgiCache::store(const std::string &key, CgiCacheEntry &entry)
+{
+	erase(key);
+	size_t size = entrySize(key, entry);
+	if (size > m_maxBytes)
+		return;
+
+	while (!m_entries.empty() && m_bytes + size > m_maxBytes)
+		erase(m_entries.back().first);
+
+	m_entries.emplace_front(key, CgiCacheEntry());
+	m_entries.front().second = std::move(entry);
+	m_entries.front().second.refreshing = false;
+	m_index[key] = m_entries.begin();
+	m_bytes += size;
+}
+
+void CgiCache::erase(const std::string &key)
+{
+	std::unordered_map<std::string, Entries::iterator>::iterator it = m_index.find(key);
+	if (it == m_index.end())
+		return;
+
+	Entries::iterator slot = it->second;
+	m_bytes -= entrySize(slot->first, slot->second);
+	m_index.erase(it);
+	m_entries.erase(slot);
+}
+
+/**
+ * The location, method and target (query included), then the value of
+ * every header named by cgi_cache_vary, so a script answering by
+ * Accept-Language or Cookie is cached once per variant. A worker serves
+ * every server and port, and the config outlives it, so the location's
+ * address tells apart the same URL on two servers.
+ */
+std::string cgiCacheKey(const Request &request, const Location_struct &location)
+{
+	std::ostringstream owner;
+	owner << static_cast<const void *>(&location);
+	std::string key = owner.str() + " " + request.getMethod() + " " + request.getPath();
+
+	for (size_t i = 0; i < location.cgi_cache_vary.size(); ++i)
+	{
+		std::string name = stringToLower(location.cgi_cache_vary[i]);
+		std::string value;
+		for (const auto &kv : request.getHeaders())
+		{
+			if (stringToLower(kv.first) == name)
+			{
+				value = kv.second;
+				break;
+			}
+		}
+		key += "\n" + name + ": " + value;
+	}
+	return key;
+}
+
+static bool parseHttpDate(const std::string &value, time_t &out)
+{
+	struct tm tm;
+	std::memset(&tm, 0, sizeof(tm));
+	const char *end = ::strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (!end || *end != '\0')
+		return false;
+	out = ::timegm(&tm);
+	return true;
+}
+
+/**
+ * Decides whether a script's answer may be cached and for how long, from
+ * the headers it sent: Cache-Control no-store / no-cache / private and
+ * Set-Cookie keep it out, s-maxage or max-age (else Expires) set the
+ * lifetime and stale-while-revalidate the stale window. A script that says
+ * nothing gets the location's cgi_cache and cgi_cache_stale seconds.
+ * Only 200 and 301 answers are kept. Fills entry when the answer is cacheable.
+ */
+bool cgiCacheFreshness(const CgiResult &result, const Location_struct &location, time_t now, CgiCacheEntry &entry)
+{
+	int status = result.status ? result.status : 200;
+	if (status != 200 && status != 301)
+		return false;
+	if (result.headers.count("set-cookie"))
+		return false;
+
+	long maxAge = -1;
+	long sharedMaxAge = -1;
+	long stale = location.cgi_cache_stale;
+
+	std::map<std::string, std::string>::const_iterator it = result.headers.find("cache-control");
+	if (it != result.headers.end())
+	{
+		std::istringstream directives(stringToLower(it->second));
+		std::string directive;
+		while (std::getline(directives, directive, ','))
+		{
+			directive.erase(0, directive.find_first_not_of(" \t"));
+			directive.erase(directive.find_last_not_of(" \t") + 1);
+
+			std::string name = directive.substr(0, directive.find('='));
+			long value = directive.size() > name.size() ? std::strtol(directive.c_str() + name.size() + 1, NULL, 10) : 0;
+			if (name == "no-store" || name == "no-cache" || name == "private")
+				return false;
+			if (name == "max-age")
+				maxAge = value;
+			else if (name == "s-maxage")
+				sharedMaxAge = value;
+			else if (name == "stale-while-revalidate")
+				stale = value;
+		}
+	}
+
+	if (sharedMaxAge >= 0)
+		maxAge = sharedMaxAge;
+	it = result.headers.find("expires");
+	if (maxAge < 0 && it != result.headers.end())
+	{
+		// an Expires that cannot be parsed means already expired
+		time_t expires = 0;
+		maxAge = parseHttpDate(it->second, expires) && expires > now ? static_cast<long>(expires - now) : 0;
+	}
+	if (maxAge < 0)
+		maxAge = location.cgi_cache;
+	if (maxAge <= 0)
+		return false;
+
+	entry.status = status;
+	entry.headers = result.headers;
+	entry.body = result.body;
+	entry.storedAt = now;
+	entry.freshUntil = now + maxAge;
+	entry.staleUntil = entry.freshUntil + std::max(stale, 0L);
+	return true;
+}
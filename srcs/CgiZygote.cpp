@@ -0,0 +1,239 @@
+#include "headers.hpp"
+
+/**
+ * The zygote itself, run as `python3 -c` with the socketpair on fd 3. It
+ * imports what the scripts usually need, keeps compiled scripts (checked
+ * against mtime and size) and forks a child per request. The child takes
+ * over the pipes and the environment and runs the script as __main__,
+ * exiting with the status python3 would have exited with.
+ */
+static const char ZYGOTE_SOURCE[] = R"PY(
+import os, sys, socket, select, signal, array, traceback
+import io, re, json, html, math, time, datetime, random, urllib.parse
+
+sock = socket.socket(fileno=3)
+wakeR, wakeW = os.pipe()
+os.set_blocking(wakeW, False)
+signal.set_wakeup_fd(wakeW)
+signal.signal(signal.SIGCHLD, lambda signum, frame: None)
+cache = {}
+
+def compiled(path):
+    try:
+        st = os.stat(path)
+        hit = cache.get(path)
+        if hit and hit[0] == (st.st_mtime_ns, st.st_size):
+            return hit[1]
+        with open(path, 'rb') as f:
+            code = compile(f.read(), path, 'exec')
+        cache[path] = ((st.st_mtime_ns, st.st_size), code)
+        return code
+    except Exception:
+        return None
+
+def child(path, env, fds, code):
+    signal.set_wakeup_fd(-1)
+    signal.signal(signal.SIGCHLD, signal.SIG_DFL)
+    os.close(wakeR)
+    os.close(wakeW)
+    sock.close()
+    os.setpgid(0, 0)
+    os.dup2(fds[0], 0)
+    os.dup2(fds[1], 1)
+    os.close(fds[0])
+    os.close(fds[1])
+    os.environ.clear()
+    os.environ.update(env)
+    sys.argv = [path]
+    sys.path[0] = os.path.dirname(path)
+    status = 0
+    try:
+        if code is None:
+            with open(path, 'rb') as f:
+                code = compile(f.read(), path, 'exec')
+        exec(code, {'__name__': '__main__', '__file__': path, '__builtins__': __builtins__})
+    except SystemExit as e:
+        if isinstance(e.code, int):
+            status = e.code
+        elif e.code is not None:
+            print(e.code, file=sys.stderr)
+            status = 1
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    try:
+        sys.stdout.flush()
+    except BaseException:
+        pass
+    os._exit(status & 0xff)
+
+def spawn(msg, fds):
+    parts = msg.split(b'\0')
+    path = os.fsdecode(parts[0])
+    env = {}
+    for item in parts[1:]:
+        name, sep, value = item.partition(b'=')
+        if sep:
+            env[os.fsdecode(name)] = os.fsdecode(value)
+    code = compiled(path)
+    pid = os.fork()
+    if pid == 0:
+        child(path, env, fds, code)
+    for fd in fds:
+        os.close(fd)
+    pidfd = -1
+    if hasattr(os, 'pidfd_open'):
+        try:
+            pidfd = os.pidfd_open(pid)
+        except OSError:
+            pass
+    anc = [(socket.SOL_SOCKET, socket.SCM_RIGHTS, array.array('i', [pidfd]))] if pidfd >= 0 else []
+    sock.sendmsg([b'P %d' % pid], anc)
+    if pidfd >= 0:
+        os.close(pidfd)
+
+while True:
+    try:
+        ready = select.select([sock, wakeR], [], [])[0]
+    except InterruptedError:
+        continue
+    if wakeR in ready:
+        try:
+            os.read(wakeR, 4096)
+        except BlockingIOError:
+            pass
+        while True:
+            try:
+                pid, status = os.waitpid(-1, os.WNOHANG)
+            except ChildProcessError:
+                break
+            if pid == 0:
+                break
+            sock.send(b'X %d %d' % (pid, status))
+    if sock in ready:
+        fds = array.array('i')
+        msg, anc, flags, addr = sock.recvmsg(1 << 20, socket.CMSG_SPACE(2 * fds.itemsize))
+        if not msg:
+            break
+        for level, kind, data in anc:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                fds.frombytes(data[:len(data) - len(data) % fds.itemsize])
+        if len(fds) == 2:
+            spawn(msg, list(fds))
+        else:
+            for fd in fds:
+                os.close(fd)
+            sock.send(b'P -1')
+)PY";
+
+// the zygote runs scripts in-process, so only a Python interpreter qualifies
+bool isZygoteInterpreter(const std::string &interpreter)
+{
+	std::string name = std::filesystem::path(interpreter).filename().string();
+	return name.rfind("python", 0) == 0;
+}
+
+bool startCgiZygote(const std::string &interpreter, CgiZygote &zygote)
+{
+	int sv[2];
+	if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+		return false;
+
+	// dup2 onto the same number would keep O_CLOEXEC, so fd 3 must come from elsewhere
+	if (sv[1] == 3)
+	{
+		int moved = ::fcntl(sv[1], F_DUPFD_CLOEXEC, 4);
+		::close(sv[1]);
+		sv[1] = moved;
+	}
+
+	std::vector<std::string> env = buildCgiEnvironment(CgiParams());
+	std::vector<char *> envp;
+	for (size_t i = 0; i < env.size(); ++i)
+		envp.push_back(const_cast<char *>(env[i].c_str()));
+	envp.push_back(NULL);
+
+	char dashC[] = "-c";
+	char *argv[] = {const_cast<char *>(interpreter.c_str()), dashC, const_cast<char *>(ZYGOTE_SOURCE), NULL};
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, sv[1], 3);
+
+	pid_t pid;
+	int err = (sv[1] < 0) ? EMFILE : posix_spawnp(&pid, argv[0], &actions, NULL, argv, envp.data());
+	posix_spawn_file_actions_destroy(&actions);
+	if (sv[1] >= 0)
+		::close(sv[1]);
+	if (err != 0)
+	{
+		::close(sv[0]);
+		errno = err;
+		return false;
+	}
+
+	int flags = ::fcntl(sv[0], F_GETFL, 0);
+	::fcntl(sv[0], F_SETFL, flags | O_NONBLOCK);
+	zygote.pid = pid;
+	zygote.fd = sv[0];
+	zygote.interpreter = interpreter;
+	return true;
+}
+
+/**
+ * Hands one request to the zygote: the child's pipe ends travel with the
+ * message (SCM_RIGHTS), the parent's ends go to proc like spawnCgi() does.
+ */
+bool sendCgiZygoteRequest(CgiZygote &zygote, const CgiParams &params, const std::string &scriptPath, CgiProcess &proc)
+{
+	std::string msg = scriptPath;
+	std::vector<std::string> env = buildCgiEnvironment(params);
+	for (size_t i = 0; i < env.size(); ++i)
+	{
+		msg += '\0';
+		msg += env[i];
+	}
+
+	int inPipe[2];
+	int outPipe[2];
+	if (!openCgiPipes(inPipe, outPipe))
+		return false;
+
+	int fds[2] = {inPipe[0], outPipe[1]};
+	char control[CMSG_SPACE(sizeof(fds))];
+	std::memset(control, 0, sizeof(control));
+
+	struct iovec iov;
+	iov.iov_base = const_cast<char *>(msg.data());
+	iov.iov_len = msg.size();
+
+	struct msghdr hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent = ::sendmsg(zygote.fd, &hdr, MSG_NOSIGNAL);
+	::close(inPipe[0]);
+	::close(outPipe[1]);
+	if (sent < 0)
+	{
+		::close(inPipe[1]);
+		::close(outPipe[0]);
+		return false;
+	}
+
+	proc.pid = -1;
+	proc.pidFd = -1;
+	proc.zygote = &zygote;
+	proc.stdinFd = inPipe[1];
+	proc.stdoutFd = outPipe[0];
+	return true;
+}
@@ -3,6 +3,8 @@
 void	configFinalCheck(const Config_struct &config) {
 	if (config.servers.empty())
         throw std::runtime_error("No servers defined in config!");
+	if (config.open_file_cache_responses && !config.open_file_cache)
+		throw std::runtime_error("open_file_cache_responses needs open_file_cache");
 
     for (size_t i = 0; i < config.servers.size(); ++i) {
         const Server_struct &srv = config.servers[i];
@@ -23,6 +25,12 @@ void	configFinalCheck(const Config_struct &config) {
         if (srv.client_max_body_size <= 0 || srv.client_max_body_size > 100*MB)
             throw std::runtime_error("Server " + std::to_string(i) + " has invalid client_max_body_size!");
 
+        if (srv.keepalive_timeout < 0)
+            throw std::runtime_error("Server " + std::to_string(i) + " has invalid keepalive_timeout!");
+
+        if (srv.client_header_timeout <= 0 || srv.client_body_timeout <= 0 || srv.send_timeout <= 0)
+            throw std::runtime_error("Server " + std::to_string(i) + " has invalid client_header_timeout, client_body_timeout or send_timeout!");
+
         for (int code : {400, 403, 404, 500}) {
             if (srv.error_pages.find(code) == srv.error_pages.end()) {
                 std::cerr << "Warning: Server " << i << " missing error_page for code " << code << std::endl;
@@ -68,14 +76,20 @@ void	configFinalCheck(const Config_struct &config) {
                         throw std::runtime_error("Server " + std::to_string(i) + " location " + std::to_string(j) + " cgi_extension contains invalid character");
 				}
 				
-				if (loc.cgi_path.empty())
-					throw std::runtime_error("Server " + std::to_string(i) + " location " + std::to_string(j) + " has cgi_extension but no cgi_path defined!");
-				else {
+				if (loc.cgi_path.empty() && loc.fastcgi_pass.empty())
+					throw std::runtime_error("Server " + std::to_string(i) + " location " + std::to_string(j) + " has cgi_extension but no cgi_path or fastcgi_pass defined!");
+				else if (loc.fastcgi_pass.empty()) {
 					struct stat statbuf;
 					if (stat(loc.cgi_path.c_str(), &statbuf) != 0)
 						throw std::runtime_error("Server " + std::to_string(i) + " location " + std::to_string(j) + " CGI path does not exist: " + loc.cgi_path);
 				}
 			}
+
+			if (loc.cgi_zygote && (loc.cgi_extension.empty() || !loc.fastcgi_pass.empty() || !isZygoteInterpreter(loc.cgi_path)))
+				throw std::runtime_error("Server " + std::to_string(i) + " location " + std::to_string(j) + " cgi_zygote needs a Python cgi_path and no fastcgi_pass");
+
+			if (loc.cgi_cache && loc.cgi_extension.empty())
+				throw std::runtime_error("Server " + std::to_string(i) + " location " + std::to_string(j) + " cgi_cache needs cgi_extension");
 		}
 
 	//check HTTP methods
@@ -54,6 +54,11 @@ bool ConfigParser::parse() {
 			currentServer.listen_port = 8080;
 			currentServer.root = "www";
 			currentServer.client_max_body_size = 1048576;
+			currentServer.keepalive_timeout = 75;
+			currentServer.keepalive_requests = 100;
+			currentServer.client_header_timeout = 60;
+			currentServer.client_body_timeout = 60;
+			currentServer.send_timeout = 60;
 
 			// Default error pages
 			for (int code : {404, 403, 500}) {
@@ -69,8 +74,13 @@ bool ConfigParser::parse() {
 		//Block closing
 		if (line == "}") {
 			if (inLocation) {
+				// a location with its own root does not get the server's pack either
 				if (currentLocation.root.empty())
+				{
 					currentLocation.root = currentServer.root;
+					if (currentLocation.root_pack.empty())
+						currentLocation.root_pack = currentServer.root_pack;
+				}
 
 				if (currentLocation.methods.empty()) {
 					// std::cerr << "Warning: location " << currentLocation.path << " has no allowed HTTP methods. Defaulting to GET.\n";
@@ -214,6 +224,22 @@ void	ConfigParser::parseLine(const std::string& line, Server_struct& server, Loc
 			server.root = path;
 	}
 
+	else if (directive == "root_pack") {
+		std::string path;
+		std::string extra;
+		if (!(iss >> path))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in root_pack");
+		removeSemicolon(lineNumber, path);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in root_pack");
+
+		// opened and checked by loadAssetPacks() once the config is complete
+		if (inLocation)
+			location.root_pack = path;
+		else
+			server.root_pack = path;
+	}
+
 	else if (directive == "index") {
 		std::string idx;
 		while (iss >> idx) {
@@ -333,6 +359,41 @@ void	ConfigParser::parseLine(const std::string& line, Server_struct& server, Loc
 		server.client_max_body_size = size;
 	}
 
+	else if (directive == "keepalive_timeout" || directive == "keepalive_requests"
+			|| directive == "client_header_timeout" || directive == "client_body_timeout"
+			|| directive == "send_timeout") {
+		std::string valueStr;
+		std::string extra;
+		if (!(iss >> valueStr))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in " + directive);
+		removeSemicolon(lineNumber, valueStr);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in " + directive);
+
+		long value;
+		try {
+			value = std::stol(valueStr);
+		}
+		catch (const std::exception& e) {
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Invalid " + directive + " number: " + valueStr);
+		}
+		if (value < 0 || value > 86400 * 365)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": " + directive + " out of range: " + valueStr);
+
+		if (directive == "keepalive_timeout")
+			server.keepalive_timeout = static_cast<int>(value);
+		else if (directive == "keepalive_requests")
+			server.keepalive_requests = static_cast<size_t>(value);
+		else if (value == 0)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": " + directive + " must be at least 1 second");
+		else if (directive == "client_header_timeout")
+			server.client_header_timeout = static_cast<int>(value);
+		else if (directive == "client_body_timeout")
+			server.client_body_timeout = static_cast<int>(value);
+		else
+			server.send_timeout = static_cast<int>(value);
+	}
+
 	else if (directive == "upload_path") {
 		std::string path;
 		std::string extra;
@@ -394,6 +455,178 @@ void	ConfigParser::parseLine(const std::string& line, Server_struct& server, Loc
 			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in cgi_path");
 		location.cgi_path = path;
 	}
+
+	else if (directive == "fastcgi_pass") {
+		std::string address;
+		std::string extra;
+		if (!(iss >> address))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing address in fastcgi_pass");
+		removeSemicolon(lineNumber, address);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in fastcgi_pass");
+		std::string error;
+		if (!resolveFastCgiAddress(address, location.fastcgi_addr, location.fastcgi_addrlen, error))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": fastcgi_pass " + error);
+		location.fastcgi_pass = address;
+	}
+
+	else if (directive == "cgi_zygote") {
+		std::string value;
+		std::string extra;
+		if (!(iss >> value))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in cgi_zygote");
+		removeSemicolon(lineNumber, value);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in cgi_zygote");
+		if (value != "on" && value != "off")
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": cgi_zygote must be on or off: " + value);
+		location.cgi_zygote = (value == "on");
+	}
+
+	else if (directive == "cgi_stats") {
+		std::string value;
+		std::string extra;
+		if (!(iss >> value))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in cgi_stats");
+		removeSemicolon(lineNumber, value);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in cgi_stats");
+		if (value != "on" && value != "off")
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": cgi_stats must be on or off: " + value);
+		location.cgi_stats = (value == "on");
+	}
+
+	else if (directive == "cgi_timeout" || directive == "cgi_max_concurrent" || directive == "cgi_queue_size"
+			|| directive == "cgi_cache" || directive == "cgi_cache_stale") {
+		std::string valueStr;
+		std::string extra;
+		if (!(iss >> valueStr))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in " + directive);
+		removeSemicolon(lineNumber, valueStr);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in " + directive);
+
+		// "cgi_cache off" reads better than 0
+		if (directive == "cgi_cache" && valueStr == "off")
+			valueStr = "0";
+		long value;
+		try {
+			value = std::stol(valueStr);
+		}
+		catch (const std::exception& e) {
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Invalid " + directive + " number: " + valueStr);
+		}
+		if (value < 0 || value > 86400)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": " + directive + " out of range: " + valueStr);
+
+		if (directive == "cgi_timeout") {
+			if (value == 0)
+				throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": cgi_timeout must be at least 1 second");
+			location.cgi_timeout = static_cast<int>(value);
+		}
+		else if (directive == "cgi_max_concurrent")
+			location.cgi_max_concurrent = static_cast<size_t>(value);
+		else if (directive == "cgi_cache")
+			location.cgi_cache = static_cast<int>(value);
+		else if (directive == "cgi_cache_stale")
+			location.cgi_cache_stale = static_cast<int>(value);
+		else
+			location.cgi_queue_size = static_cast<size_t>(value);
+	}
+
+	else if (directive == "cgi_cache_vary") {
+		std::string header;
+		while (iss >> header)
+			location.cgi_cache_vary.push_back(header);
+		if (location.cgi_cache_vary.empty())
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in cgi_cache_vary");
+		removeSemicolon(lineNumber, location.cgi_cache_vary.back());
+	}
+
+	else if (directive == "event_backend") {
+		std::string backend;
+		std::string extra;
+		if (!(iss >> backend))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in event_backend");
+		removeSemicolon(lineNumber, backend);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in event_backend");
+		if (backend != "epoll" && backend != "epoll_et" && backend != "poll")
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": event_backend must be epoll, epoll_et or poll: " + backend);
+		config.event_backend = backend;
+	}
+
+	else if (directive == "worker_threads") {
+		std::string countStr;
+		std::string extra;
+		if (!(iss >> countStr))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in worker_threads");
+		removeSemicolon(lineNumber, countStr);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in worker_threads");
+
+		int count;
+		if (countStr == "auto")
+			count = std::max(1u, std::thread::hardware_concurrency());
+		else {
+			try {
+				count = std::stoi(countStr);
+			}
+			catch (const std::exception& e) {
+				throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Invalid worker_threads number: " + countStr);
+			}
+		}
+		if (count < 1 || count > 1024)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": worker_threads must be between 1 and 1024: " + countStr);
+		config.worker_threads = count;
+	}
+
+	else if (directive == "open_file_cache") {
+		std::string valueStr;
+		std::string extra;
+		if (!(iss >> valueStr))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in open_file_cache");
+		removeSemicolon(lineNumber, valueStr);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in open_file_cache");
+
+		long value = 0;
+		if (valueStr != "off") {
+			try {
+				value = std::stol(valueStr);
+			}
+			catch (const std::exception& e) {
+				throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Invalid open_file_cache number: " + valueStr);
+			}
+		}
+		// every entry holds an open fd
+		if (value < 0 || value > 65536)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": open_file_cache must be off or between 0 and 65536: " + valueStr);
+		config.open_file_cache = static_cast<size_t>(value);
+	}
+
+	else if (directive == "open_file_cache_responses") {
+		std::string valueStr;
+		std::string extra;
+		if (!(iss >> valueStr))
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Missing value in open_file_cache_responses");
+		removeSemicolon(lineNumber, valueStr);
+		if (iss >> extra)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Too many Args in open_file_cache_responses");
+
+		long value = 0;
+		if (valueStr != "off") {
+			try {
+				value = std::stol(valueStr);
+			}
+			catch (const std::exception& e) {
+				throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": Invalid open_file_cache_responses number: " + valueStr);
+			}
+		}
+		if (value < 0 || value > 1024 * MB)
+			throw std::runtime_error("File " + filename + " Line " + std::to_string(lineNumber) + ": open_file_cache_responses must be off or between 0 and 1073741824 bytes: " + valueStr);
+		config.open_file_cache_responses = static_cast<size_t>(value);
+	}
 }
 
 
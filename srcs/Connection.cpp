@@ -0,0 +1,36 @@
+#include "headers.hpp"
+
+static void releaseBuffer(std::string &buffer)
+{
+	// a slot is reused by the next accept(): keep small buffers, give big ones back
+	if (buffer.capacity() > 64 * 1024)
+		std::string().swap(buffer);
+	else
+		buffer.clear();
+}
+
+void Connection::reset()
+{
+	fd = -1;
+	listenerFd = -1;
+	server = NULL;
+	releaseBuffer(inbuf);
+	output.clear();
+	framer.reset();
+	interest = 0;
+	requestCount = 0;
+	closeAfterWrite = false;
+	timerKind = TIMER_NONE;
+	bodyRouted = false;
+	upload.reset();
+	uploadRequest = Request();
+	cgi.reset();
+}
+
+size_t Connection::pendingOutput() const
+{
+	size_t total = 0;
+	for (size_t i = 0; i < output.size(); ++i)
+		total += output[i].remaining();
+	return total;
+}
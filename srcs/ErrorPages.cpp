@@ -0,0 +1,107 @@
+#include "headers.hpp"
+
+static bool readWholeFile(const std::string &path, std::string &out)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file.is_open())
+		return false;
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	out = buffer.str();
+	return true;
+}
+
+std::string ErrorPages::body(int code) const
+{
+	std::map<int, std::string>::const_iterator it = bodies.find(code);
+	if (it != bodies.end())
+		return it->second;
+	if (!fallback.empty())
+		return fallback;
+	return "<html><head><title>" + std::to_string(code) + " " + Response::getDefaultMessage(code)
+		   + "</title></head><body><h1>" + std::to_string(code) + " " + Response::getDefaultMessage(code)
+		   + "</h1></body></html>";
+}
+
+std::shared_ptr<const std::string> ErrorPages::response(int code, bool keepAlive) const
+{
+	const std::map<int, std::shared_ptr<const std::string> > &table = keepAlive ? this->keepAlive : closing;
+	std::map<int, std::shared_ptr<const std::string> >::const_iterator it = table.find(code);
+	return it == table.end() ? std::shared_ptr<const std::string>() : it->second;
+}
+
+static std::shared_ptr<const std::string> serializeErrorPage(const Server_struct &server, int code,
+															 const std::string &body, bool keepAlive)
+{
+	Response res;
+	res.setStatus(code, Response::getDefaultMessage(code));
+	res.setBody(body);
+	res.setHeader("Content-Type", "text/html");
+	res.setHeader("Content-Length", std::to_string(body.size()));
+	if (keepAlive)
+	{
+		res.setHeader("Connection", "keep-alive");
+		res.setHeader("Keep-Alive", "timeout=" + std::to_string(server.keepalive_timeout));
+	}
+	else
+		res.setHeader("Connection", "close");
+	return std::make_shared<const std::string>(res.serializer());
+}
+
+/**
+ * Reads the pages of one server and serializes an answer for every error
+ * code it has a page for or a reason phrase for; any other code is still
+ * answered, through Response::fromErrorCode with the loaded bodies.
+ */
+static std::shared_ptr<const ErrorPages> buildErrorPages(const Server_struct &server)
+{
+	std::shared_ptr<ErrorPages> pages = std::make_shared<ErrorPages>();
+	for (std::map<int, std::string>::const_iterator it = server.error_pages.begin(); it != server.error_pages.end(); ++it)
+	{
+		// a page that cannot be read falls back like a code without one
+		std::string body;
+		if (readWholeFile(it->second, body))
+			pages->bodies[it->first] = body;
+	}
+	readWholeFile(server.root + "/error.html", pages->fallback);
+
+	for (int code = 400; code < 600; ++code)
+	{
+		if (!server.error_pages.count(code) && Response::getDefaultMessage(code) == "Unknown Error")
+			continue;
+		std::string body = pages->body(code);
+		pages->closing[code] = serializeErrorPage(server, code, body, false);
+		if (server.keepalive_timeout > 0)
+			pages->keepAlive[code] = serializeErrorPage(server, code, body, true);
+	}
+	return pages;
+}
+
+// at startup, before the workers share the config
+void loadErrorPages(Config_struct &config)
+{
+	for (size_t i = 0; i < config.servers.size(); ++i)
+		config.servers[i].error_responses = buildErrorPages(config.servers[i]);
+}
+
+/**
+ * Reads the pages again (SIGHUP) and swaps them in; answers already queued
+ * keep the buffers they hold.
+ */
+void reloadErrorPages(const Config_struct &config)
+{
+	for (size_t i = 0; i < config.servers.size(); ++i)
+		std::atomic_store(&config.servers[i].error_responses, buildErrorPages(config.servers[i]));
+}
+
+std::shared_ptr<const ErrorPages> currentErrorPages(const Server_struct &server)
+{
+	std::shared_ptr<const ErrorPages> pages = std::atomic_load(&server.error_responses);
+	// a config that did not go through loadErrorPages()
+	if (!pages)
+	{
+		pages = buildErrorPages(server);
+		std::atomic_store(&server.error_responses, pages);
+	}
+	return pages;
+}
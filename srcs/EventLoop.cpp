@@ -0,0 +1,200 @@
+#include "headers.hpp"
+
+static uint32_t toEpollEvents(unsigned interest, bool edgeTriggered)
+{
+	uint32_t ev = 0;
+	if (interest & EventLoop::EV_READ)
+		ev |= EPOLLIN;
+	if (interest & EventLoop::EV_WRITE)
+		ev |= EPOLLOUT;
+	if (interest & EventLoop::EV_PEER_CLOSED)
+		ev |= EPOLLRDHUP;
+	if (edgeTriggered)
+		ev |= EPOLLET;
+	return ev;
+}
+
+static short toPollEvents(unsigned interest)
+{
+	short ev = 0;
+	if (interest & EventLoop::EV_READ)
+		ev |= POLLIN;
+	if (interest & EventLoop::EV_WRITE)
+		ev |= POLLOUT;
+	if (interest & EventLoop::EV_PEER_CLOSED)
+		ev |= POLLRDHUP;
+	return ev;
+}
+
+EventLoop::EventLoop(Backend backend) : m_backend(backend), m_epollFd(-1)
+{
+	if (m_backend == POLL)
+		return;
+
+	m_epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+	if (m_epollFd < 0)
+	{
+		perror("epoll_create1");
+		std::cerr << "Falling back to poll() event backend" << std::endl;
+		m_backend = POLL;
+		return;
+	}
+	m_epollEvents.resize(256);
+}
+
+EventLoop::~EventLoop()
+{
+	if (m_epollFd >= 0)
+		::close(m_epollFd);
+}
+
+EventLoop::Backend EventLoop::getBackend() const
+{
+	return m_backend;
+}
+
+bool EventLoop::isEdgeTriggered() const
+{
+	return m_backend == EPOLL_EDGE;
+}
+
+EventLoop::Backend EventLoop::backendFromName(const std::string &name)
+{
+	if (name == "poll")
+		return POLL;
+	if (name == "epoll_et")
+		return EPOLL_EDGE;
+	return EPOLL_LEVEL;
+}
+
+bool EventLoop::add(int fd, unsigned interest)
+{
+	if (fd < 0)
+		return false;
+
+	if (m_backend != POLL)
+	{
+		struct epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.events = toEpollEvents(interest, isEdgeTriggered());
+		ev.data.fd = fd;
+		if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			perror("epoll_ctl(ADD)");
+			return false;
+		}
+		return true;
+	}
+
+	if (static_cast<size_t>(fd) >= m_pollSlot.size())
+		m_pollSlot.resize(fd + 1, -1);
+	if (m_pollSlot[fd] != -1)
+		return modify(fd, interest);
+
+	m_pollSlot[fd] = static_cast<int>(m_pollFds.size());
+	m_pollFds.push_back({fd, toPollEvents(interest), 0});
+	return true;
+}
+
+bool EventLoop::modify(int fd, unsigned interest)
+{
+	if (m_backend != POLL)
+	{
+		struct epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.events = toEpollEvents(interest, isEdgeTriggered());
+		ev.data.fd = fd;
+		if (::epoll_ctl(m_epollFd, EPOLL_CTL_MOD, fd, &ev) < 0)
+		{
+			perror("epoll_ctl(MOD)");
+			return false;
+		}
+		return true;
+	}
+
+	if (fd < 0 || static_cast<size_t>(fd) >= m_pollSlot.size() || m_pollSlot[fd] == -1)
+		return false;
+	m_pollFds[m_pollSlot[fd]].events = toPollEvents(interest);
+	return true;
+}
+
+void EventLoop::remove(int fd)
+{
+	if (m_backend != POLL)
+	{
+		// closing the fd would drop it from the set too, but only once every dup is gone
+		::epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, NULL);
+		return;
+	}
+
+	if (fd < 0 || static_cast<size_t>(fd) >= m_pollSlot.size() || m_pollSlot[fd] == -1)
+		return;
+
+	size_t slot = m_pollSlot[fd];
+	size_t last = m_pollFds.size() - 1;
+	if (slot != last)
+	{
+		m_pollFds[slot] = m_pollFds[last];
+		m_pollSlot[m_pollFds[slot].fd] = static_cast<int>(slot);
+	}
+	m_pollFds.pop_back();
+	m_pollSlot[fd] = -1;
+}
+
+int EventLoop::wait(int timeoutMs, std::vector<Event> &ready)
+{
+	ready.clear();
+
+	if (m_backend != POLL)
+	{
+		int n = ::epoll_wait(m_epollFd, m_epollEvents.data(), static_cast<int>(m_epollEvents.size()), timeoutMs);
+		if (n < 0)
+			return (errno == EINTR) ? 0 : -1;
+
+		for (int i = 0; i < n; ++i)
+		{
+			uint32_t ev = m_epollEvents[i].events;
+			unsigned out = 0;
+			if (ev & EPOLLIN)
+				out |= EV_READ;
+			if (ev & EPOLLOUT)
+				out |= EV_WRITE;
+			if (ev & EPOLLERR)
+				out |= EV_ERROR;
+			if (ev & EPOLLHUP)
+				out |= EV_HANGUP;
+			if (ev & EPOLLRDHUP)
+				out |= EV_PEER_CLOSED;
+			ready.push_back({m_epollEvents[i].data.fd, out});
+		}
+
+		if (static_cast<size_t>(n) == m_epollEvents.size())
+			m_epollEvents.resize(m_epollEvents.size() * 2);
+		return n;
+	}
+
+	int n = ::poll(m_pollFds.data(), m_pollFds.size(), timeoutMs);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (size_t i = 0; i < m_pollFds.size() && ready.size() < static_cast<size_t>(n); ++i)
+	{
+		short ev = m_pollFds[i].revents;
+		if (!ev)
+			continue;
+
+		unsigned out = 0;
+		if (ev & POLLIN)
+			out |= EV_READ;
+		if (ev & POLLOUT)
+			out |= EV_WRITE;
+		if (ev & (POLLERR | POLLNVAL))
+			out |= EV_ERROR;
+		if (ev & POLLHUP)
+			out |= EV_HANGUP;
+		if (ev & POLLRDHUP)
+			out |= EV_PEER_CLOSED;
+		ready.push_back({m_pollFds[i].fd, out});
+	}
+	return static_cast<int>(ready.size());
+}
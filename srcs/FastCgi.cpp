@@ -0,0 +1,197 @@
+#include "headers.hpp"
+
+// a pooled connection keeps at most this many ids alive; the lowest free one is reused
+static const uint16_t FCGI_MAX_ID = 1024;
+
+uint16_t FastCgiConnection::allocateId()
+{
+	for (uint16_t tries = 0; tries < FCGI_MAX_ID; ++tries)
+	{
+		uint16_t id = nextId;
+		nextId = (nextId >= FCGI_MAX_ID) ? 1 : nextId + 1;
+		if (!requests.count(id))
+			return id;
+	}
+	return 0;
+}
+
+static bool splitHostPort(const std::string &address, std::string &host, std::string &port)
+{
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+		return false;
+	host = address.substr(0, colon);
+	port = address.substr(colon + 1);
+	for (size_t i = 0; i < port.size(); ++i)
+	{
+		if (!std::isdigit(static_cast<unsigned char>(port[i])))
+			return false;
+	}
+	long value = std::strtol(port.c_str(), NULL, 10);
+	return value > 0 && value <= 65535;
+}
+
+/**
+ * Turns a fastcgi_pass address into the socket address connected to at
+ * runtime. Host names are looked up here, once, while the config is
+ * loaded: a lookup in a worker would hold up its whole event loop.
+ */
+bool resolveFastCgiAddress(const std::string &address, struct sockaddr_storage &out, socklen_t &length,
+						   std::string &error)
+{
+	std::memset(&out, 0, sizeof(out));
+	if (address.rfind("unix:", 0) == 0)
+	{
+		struct sockaddr_un addr;
+		if (address.size() == 5 || address.size() - 5 >= sizeof(addr.sun_path))
+		{
+			error = "must be unix:/path or host:port: " + address;
+			return false;
+		}
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, address.c_str() + 5, sizeof(addr.sun_path) - 1);
+		std::memcpy(&out, &addr, sizeof(addr));
+		length = sizeof(addr);
+		return true;
+	}
+
+	std::string host, port;
+	if (!splitHostPort(address, host, port))
+	{
+		error = "must be unix:/path or host:port: " + address;
+		return false;
+	}
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int ret = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if (ret != 0 || !res)
+	{
+		error = "cannot resolve " + address + ": " + ::gai_strerror(ret);
+		return false;
+	}
+	std::memcpy(&out, res->ai_addr, res->ai_addrlen);
+	length = res->ai_addrlen;
+	::freeaddrinfo(res);
+	return true;
+}
+
+// starts a non-blocking connect(); completion is reported as writability
+int fastCgiConnect(const struct sockaddr_storage &addr, socklen_t length)
+{
+	int fd = ::socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (::connect(fd, reinterpret_cast<const struct sockaddr *>(&addr), length) < 0
+		&& errno != EINPROGRESS && errno != EAGAIN)
+	{
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void fastCgiAppendRecord(std::string &out, unsigned char type, uint16_t id, const char *data, size_t len)
+{
+	char header[FCGI_HEADER_LEN];
+	header[0] = 1;
+	header[1] = static_cast<char>(type);
+	header[2] = static_cast<char>(id >> 8);
+	header[3] = static_cast<char>(id & 0xff);
+	header[4] = static_cast<char>(len >> 8);
+	header[5] = static_cast<char>(len & 0xff);
+	header[6] = 0;
+	header[7] = 0;
+	out.append(header, sizeof(header));
+	out.append(data, len);
+}
+
+static void appendLength(std::string &out, size_t len)
+{
+	if (len < 128)
+	{
+		out += static_cast<char>(len);
+		return;
+	}
+	out += static_cast<char>(((len >> 24) & 0x7f) | 0x80);
+	out += static_cast<char>((len >> 16) & 0xff);
+	out += static_cast<char>((len >> 8) & 0xff);
+	out += static_cast<char>(len & 0xff);
+}
+
+void fastCgiAppendParam(std::string &out, const std::string &name, const std::string &value)
+{
+	appendLength(out, name.size());
+	appendLength(out, value.size());
+	out += name;
+	out += value;
+}
+
+// splits a stream into records of at most FCGI_MAX_CONTENT bytes, then closes it with an empty one
+static void appendStream(std::string &out, unsigned char type, uint16_t id, const std::string &data)
+{
+	for (size_t pos = 0; pos < data.size(); pos += FCGI_MAX_CONTENT)
+		fastCgiAppendRecord(out, type, id, data.data() + pos, std::min(FCGI_MAX_CONTENT, data.size() - pos));
+	fastCgiAppendRecord(out, type, id, "", 0);
+}
+
+void fastCgiEncodeRequest(std::string &out, uint16_t id, const CgiParams &params, const std::string &body)
+{
+	// role RESPONDER, FCGI_KEEP_CONN: the connection goes back to the pool afterwards
+	const char begin[8] = {0, 1, 1, 0, 0, 0, 0, 0};
+	fastCgiAppendRecord(out, FCGI_BEGIN_REQUEST, id, begin, sizeof(begin));
+
+	std::string encoded;
+	for (size_t i = 0; i < params.size(); ++i)
+		fastCgiAppendParam(encoded, params[i].first, params[i].second);
+	appendStream(out, FCGI_PARAMS, id, encoded);
+	appendStream(out, FCGI_STDIN, id, body);
+}
+
+// asks whether the application multiplexes requests on one connection
+void fastCgiEncodeGetValues(std::string &out)
+{
+	std::string query;
+	fastCgiAppendParam(query, "FCGI_MPXS_CONNS", "");
+	fastCgiAppendParam(query, "FCGI_MAX_REQS", "");
+	fastCgiAppendRecord(out, FCGI_GET_VALUES, 0, query.data(), query.size());
+}
+
+static bool readLength(const unsigned char *p, size_t len, size_t &pos, size_t &value)
+{
+	if (pos >= len)
+		return false;
+	if (!(p[pos] & 0x80))
+	{
+		value = p[pos++];
+		return true;
+	}
+	if (pos + 4 > len)
+		return false;
+	value = (static_cast<size_t>(p[pos] & 0x7f) << 24) | (static_cast<size_t>(p[pos + 1]) << 16)
+		| (static_cast<size_t>(p[pos + 2]) << 8) | p[pos + 3];
+	pos += 4;
+	return true;
+}
+
+std::map<std::string, std::string> fastCgiDecodeParams(const char *data, size_t len)
+{
+	std::map<std::string, std::string> params;
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+	size_t pos = 0;
+
+	while (pos < len)
+	{
+		size_t nameLen, valueLen;
+		if (!readLength(p, len, pos, nameLen) || !readLength(p, len, pos, valueLen))
+			break;
+		if (nameLen + valueLen > len - pos)
+			break;
+		params[std::string(data + pos, nameLen)] = std::string(data + pos + nameLen, valueLen);
+		pos += nameLen + valueLen;
+	}
+	return params;
+}
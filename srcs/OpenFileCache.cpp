@@ -0,0 +1,306 @@
+#include "headers.hpp"
+
+// what makes a cached resolution wrong: its file changing, or a path on the way to it appearing or going
+static const uint32_t OPEN_FILE_EVENTS = IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+										 | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// only small files are worth a copy in memory, larger ones go out with sendfile() anyway
+static const size_t RESPONSE_MAX_BYTES = 256 * 1024;
+
+OpenFileCache::OpenFileCache() : m_fd(-1), m_maxEntries(0), m_maxResponseBytes(0), m_responseBytes(0)
+{
+}
+
+OpenFileCache::~OpenFileCache()
+{
+	if (m_fd >= 0)
+		::close(m_fd);
+}
+
+bool OpenFileCache::enable(size_t maxEntries, size_t maxResponseBytes)
+{
+	m_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd < 0)
+		return false;
+	m_maxEntries = maxEntries;
+	m_maxResponseBytes = maxResponseBytes;
+	return true;
+}
+
+void OpenFileCache::disable()
+{
+	clear();
+	if (m_fd >= 0)
+		::close(m_fd);
+	m_fd = -1;
+	m_maxEntries = 0;
+	m_maxResponseBytes = 0;
+}
+
+const OpenFile *OpenFileCache::find(const std::string &key)
+{
+	std::unordered_map<std::string, Entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end())
+		return NULL;
+	std::list<std::string> &lru = it->second.file.missing ? m_missingLru : m_lru;
+	lru.splice(lru.begin(), lru, it->second.lru);
+	it->second.hits++;
+	return &it->second.file;
+}
+
+std::shared_ptr<const std::string> OpenFileCache::findResponse(const std::string &key, const std::string &variant)
+{
+	std::unordered_map<std::string, Entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end())
+		return std::shared_ptr<const std::string>();
+	Entry &entry = it->second;
+	std::map<std::string, std::shared_ptr<const std::string> >::iterator response = entry.responses.find(variant);
+	if (response == entry.responses.end())
+		return std::shared_ptr<const std::string>();
+	m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+	m_responseLru.splice(m_responseLru.begin(), m_responseLru, entry.responseLru);
+	return response->second;
+}
+
+// a file is copied into memory on its second request, so files asked for once never push hot ones out
+bool OpenFileCache::wantsResponse(const std::string &key, size_t length) const
+{
+	if (!m_maxResponseBytes || length > std::min(RESPONSE_MAX_BYTES, m_maxResponseBytes))
+		return false;
+	std::unordered_map<std::string, Entry>::const_iterator it = m_entries.find(key);
+	return it != m_entries.end() && it->second.file.body && it->second.hits > 0;
+}
+
+void OpenFileCache::storeResponse(const std::string &key,
+								  const std::string &variant,
+								  const std::shared_ptr<const std::string> &bytes)
+{
+	std::unordered_map<std::string, Entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end() || bytes->size() > m_maxResponseBytes)
+		return;
+
+	Entry &entry = it->second;
+	if (entry.responses.empty())
+	{
+		m_responseLru.push_front(key);
+		entry.responseLru = m_responseLru.begin();
+	}
+	else
+		m_responseLru.splice(m_responseLru.begin(), m_responseLru, entry.responseLru);
+
+	std::shared_ptr<const std::string> &slot = entry.responses[variant];
+	if (slot)
+		m_responseBytes -= slot->size();
+	slot = bytes;
+	m_responseBytes += bytes->size();
+
+	// connections still sending an evicted response keep their reference until done
+	while (m_responseBytes > m_maxResponseBytes && m_responseLru.back() != key)
+		dropResponses(m_entries[m_responseLru.back()]);
+}
+
+void OpenFileCache::dropResponses(Entry &entry)
+{
+	if (entry.responses.empty())
+		return;
+	for (std::map<std::string, std::shared_ptr<const std::string> >::iterator it = entry.responses.begin();
+		 it != entry.responses.end(); ++it)
+		m_responseBytes -= it->second->size();
+	entry.responses.clear();
+	m_responseLru.erase(entry.responseLru);
+}
+
+/**
+ * Keeps a resolution that looked at paths, all inside root. Nothing is
+ * kept when one of the directories on the way cannot be watched, since
+ * the entry could not be dropped when that directory changes; one that
+ * does not exist (or is not a directory) needs no watch, its parent sees
+ * it appear.
+ */
+void OpenFileCache::store(const std::string &key,
+						  const OpenFile &file,
+						  const std::string &root,
+						  const std::vector<std::string> &paths)
+{
+	if (m_fd < 0 || !m_maxEntries)
+		return;
+	erase(key);
+
+	std::set<std::string> dirs;
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		std::string dir = paths[i];
+		while (dir.size() > root.size())
+		{
+			dir.erase(dir.rfind('/'));
+			if (dir.compare(0, root.size(), root) != 0)
+				break;
+			dirs.insert(dir.empty() ? "/" : dir);
+		}
+	}
+
+	Entry entry;
+	entry.file = file;
+	entry.paths = paths;
+	for (std::set<std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it)
+	{
+		if (!watch(*it))
+		{
+			if (errno == ENOENT || errno == ENOTDIR)
+				continue;
+			for (size_t i = 0; i < entry.dirs.size(); ++i)
+				unwatch(entry.dirs[i]);
+			return;
+		}
+		entry.dirs.push_back(*it);
+	}
+
+	std::list<std::string> &lru = file.missing ? m_missingLru : m_lru;
+	while (lru.size() >= m_maxEntries)
+		erase(lru.back());
+
+	lru.push_front(key);
+	entry.lru = lru.begin();
+	for (size_t i = 0; i < paths.size(); ++i)
+		m_dependents.insert(std::make_pair(paths[i], key));
+	m_entries[key] = entry;
+}
+
+bool OpenFileCache::watch(const std::string &dir)
+{
+	std::unordered_map<std::string, Watch>::iterator it = m_watches.find(dir);
+	if (it != m_watches.end())
+	{
+		it->second.refs++;
+		return true;
+	}
+
+	int wd = ::inotify_add_watch(m_fd, dir.c_str(), OPEN_FILE_EVENTS);
+	if (wd < 0)
+		return false;
+	Watch &added = m_watches[dir];
+	added.wd = wd;
+	added.refs = 1;
+	m_watchDirs[wd] = dir;
+	return true;
+}
+
+void OpenFileCache::unwatch(const std::string &dir)
+{
+	std::unordered_map<std::string, Watch>::iterator it = m_watches.find(dir);
+	if (it == m_watches.end() || --it->second.refs)
+		return;
+	::inotify_rm_watch(m_fd, it->second.wd);
+	m_watchDirs.erase(it->second.wd);
+	m_watches.erase(it);
+}
+
+void OpenFileCache::erase(const std::string &key)
+{
+	std::unordered_map<std::string, Entry>::iterator it = m_entries.find(key);
+	if (it == m_entries.end())
+		return;
+
+	Entry &entry = it->second;
+	for (size_t i = 0; i < entry.paths.size(); ++i)
+	{
+		typedef std::multimap<std::string, std::string>::iterator Dependent;
+		std::pair<Dependent, Dependent> range = m_dependents.equal_range(entry.paths[i]);
+		for (Dependent dep = range.first; dep != range.second; ++dep)
+		{
+			if (dep->second == key)
+			{
+				m_dependents.erase(dep);
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < entry.dirs.size(); ++i)
+		unwatch(entry.dirs[i]);
+	dropResponses(entry);
+	(entry.file.missing ? m_missingLru : m_lru).erase(entry.lru);
+	m_entries.erase(it);
+}
+
+// drops every entry that looked at path or at something below it
+void OpenFileCache::invalidate(const std::string &path)
+{
+	std::vector<std::string> keys;
+	for (std::multimap<std::string, std::string>::iterator it = m_dependents.lower_bound(path);
+		 it != m_dependents.end() && it->first.compare(0, path.size(), path) == 0; ++it)
+	{
+		if (it->first.size() == path.size() || it->first[path.size()] == '/')
+			keys.push_back(it->second);
+	}
+	for (size_t i = 0; i < keys.size(); ++i)
+		erase(keys[i]);
+}
+
+void OpenFileCache::clear()
+{
+	for (std::unordered_map<std::string, Watch>::iterator it = m_watches.begin(); it != m_watches.end(); ++it)
+		::inotify_rm_watch(m_fd, it->second.wd);
+	m_entries.clear();
+	m_lru.clear();
+	m_missingLru.clear();
+	m_responseLru.clear();
+	m_responseBytes = 0;
+	m_dependents.clear();
+	m_watches.clear();
+	m_watchDirs.clear();
+}
+
+/**
+ * Reads what inotify reported so far. Also called right after the server
+ * changed files itself (DELETE, uploads), whose events are already queued
+ * by then, so the next request in the same turn of the loop sees the change.
+ */
+void OpenFileCache::handleEvents()
+{
+	if (m_fd < 0)
+		return;
+
+	alignas(struct inotify_event) char buffer[4096];
+	while (true)
+	{
+		ssize_t n = ::read(m_fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+
+		for (ssize_t off = 0; off < n;)
+		{
+			const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(buffer + off);
+			off += sizeof(struct inotify_event) + ev->len;
+
+			// events were lost: nothing cached can be trusted
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				clear();
+				continue;
+			}
+
+			std::unordered_map<int, std::string>::iterator dir = m_watchDirs.find(ev->wd);
+			if (dir == m_watchDirs.end())
+				continue;
+			std::string path = dir->second;
+			if (ev->len)
+				invalidate(path == "/" ? "/" + std::string(ev->name) : path + "/" + ev->name);
+			else
+				invalidate(path);
+
+			// the directory itself is gone, and so is its watch
+			if ((ev->mask & IN_IGNORED) && m_watches.count(path))
+			{
+				m_watchDirs.erase(ev->wd);
+				m_watches.erase(path);
+			}
+		}
+	}
+}
+
+std::string openFileKey(const std::string &docroot, const std::string &index, const std::string &path)
+{
+	return docroot + "\n" + index + "\n" + path;
+}
@@ -0,0 +1,293 @@
+#include "headers.hpp"
+
+RequestFramer::RequestFramer() : m_maxBodySize(0)
+{
+	reset();
+}
+
+void RequestFramer::reset()
+{
+	m_state = HEADERS;
+	m_scanPos = 0;
+	m_headerLength = 0;
+	m_contentLength = 0;
+	m_chunked = false;
+	m_chunkRemaining = 0;
+	m_bodyLength = 0;
+	m_errorStatus = 0;
+}
+
+void RequestFramer::setMaxBodySize(size_t maxBodySize)
+{
+	m_maxBodySize = maxBodySize;
+}
+
+bool RequestFramer::headersComplete() const
+{
+	return m_state != HEADERS && m_state != FAILED;
+}
+
+bool RequestFramer::isChunked() const
+{
+	return m_chunked;
+}
+
+size_t RequestFramer::headerLength() const
+{
+	return m_headerLength;
+}
+
+size_t RequestFramer::contentLength() const
+{
+	return m_contentLength;
+}
+
+size_t RequestFramer::requestLength() const
+{
+	return m_state == DONE ? m_scanPos : 0;
+}
+
+int RequestFramer::errorStatus() const
+{
+	return m_errorStatus;
+}
+
+RequestFramer::Result RequestFramer::fail(int status)
+{
+	m_state = FAILED;
+	m_errorStatus = status;
+	return ERROR;
+}
+
+static bool headerNameIs(const std::string &buf, size_t start, size_t end, const char *name)
+{
+	size_t len = std::strlen(name);
+	if (end - start != len)
+		return false;
+	for (size_t i = 0; i < len; ++i)
+	{
+		if (std::tolower(static_cast<unsigned char>(buf[start + i])) != name[i])
+			return false;
+	}
+	return true;
+}
+
+// reads Content-Length / Transfer-Encoding straight out of the head, without copying it
+bool RequestFramer::parseFramingHeaders(const std::string &buf)
+{
+	bool haveLength = false;
+	size_t lineStart = buf.find("\r\n");
+
+	while (lineStart != std::string::npos && lineStart + 2 < m_headerLength - 2)
+	{
+		lineStart += 2;
+		size_t lineEnd = buf.find("\r\n", lineStart);
+		size_t colon = buf.find(':', lineStart);
+		if (colon == std::string::npos || colon > lineEnd)
+		{
+			lineStart = lineEnd;
+			continue;
+		}
+
+		size_t valueStart = colon + 1;
+		while (valueStart < lineEnd && (buf[valueStart] == ' ' || buf[valueStart] == '\t'))
+			valueStart++;
+		size_t valueEnd = lineEnd;
+		while (valueEnd > valueStart && (buf[valueEnd - 1] == ' ' || buf[valueEnd - 1] == '\t'))
+			valueEnd--;
+
+		if (headerNameIs(buf, lineStart, colon, "content-length"))
+		{
+			if (valueStart == valueEnd)
+				return false;
+			size_t value = 0;
+			for (size_t i = valueStart; i < valueEnd; ++i)
+			{
+				if (!std::isdigit(static_cast<unsigned char>(buf[i])) || value > (SIZE_MAX - 9) / 10)
+					return false;
+				value = value * 10 + (buf[i] - '0');
+			}
+			if (haveLength && value != m_contentLength)
+				return false;
+			m_contentLength = value;
+			haveLength = true;
+		}
+		else if (headerNameIs(buf, lineStart, colon, "transfer-encoding"))
+		{
+			m_chunked = stringToLower(buf.substr(valueStart, valueEnd - valueStart)) == "chunked";
+		}
+		lineStart = lineEnd;
+	}
+
+	// chunked framing wins over a Content-Length sent alongside it
+	if (m_chunked)
+		m_contentLength = 0;
+	return true;
+}
+
+RequestFramer::Result RequestFramer::scanChunked(const std::string &buf, std::string *bodyOut)
+{
+	while (true)
+	{
+		switch (m_state)
+		{
+		case CHUNK_SIZE:
+		{
+			size_t eol = buf.find("\r\n", m_scanPos);
+			if (eol == std::string::npos)
+			{
+				if (buf.size() - m_scanPos > MAX_CHUNK_LINE)
+					return fail(400);
+				return INCOMPLETE;
+			}
+
+			size_t size = 0;
+			size_t digits = 0;
+			for (size_t i = m_scanPos; i < eol && std::isxdigit(static_cast<unsigned char>(buf[i])); ++i, ++digits)
+			{
+				if (size > (SIZE_MAX >> 4))
+					return fail(413);
+				size = (size << 4) | static_cast<size_t>(std::isdigit(static_cast<unsigned char>(buf[i])) ? buf[i] - '0' : (std::tolower(buf[i]) - 'a' + 10));
+			}
+			if (!digits)
+				return fail(400);
+
+			m_scanPos = eol + 2;
+			if (size == 0)
+			{
+				m_state = TRAILERS;
+				break;
+			}
+			m_bodyLength += size;
+			if (m_maxBodySize && m_bodyLength > m_maxBodySize)
+				return fail(413);
+			m_chunkRemaining = size;
+			m_state = CHUNK_DATA;
+			break;
+		}
+		case CHUNK_DATA:
+		{
+			size_t available = buf.size() - m_scanPos;
+			size_t take = std::min(available, m_chunkRemaining);
+			if (bodyOut)
+				bodyOut->append(buf, m_scanPos, take);
+			m_scanPos += take;
+			m_chunkRemaining -= take;
+			if (m_chunkRemaining)
+				return INCOMPLETE;
+			m_state = CHUNK_CRLF;
+			break;
+		}
+		case CHUNK_CRLF:
+			if (buf.size() - m_scanPos < 2)
+				return INCOMPLETE;
+			if (buf[m_scanPos] != '\r' || buf[m_scanPos + 1] != '\n')
+				return fail(400);
+			m_scanPos += 2;
+			m_state = CHUNK_SIZE;
+			break;
+		case TRAILERS:
+		{
+			size_t eol = buf.find("\r\n", m_scanPos);
+			if (eol == std::string::npos)
+			{
+				if (buf.size() - m_scanPos > MAX_HEADER_SIZE)
+					return fail(431);
+				return INCOMPLETE;
+			}
+			bool emptyLine = (eol == m_scanPos);
+			m_scanPos = eol + 2;
+			if (emptyLine)
+			{
+				m_state = DONE;
+				return COMPLETE;
+			}
+			break;
+		}
+		default:
+			return fail(400);
+		}
+	}
+}
+
+void RequestFramer::rewindBody()
+{
+	if (!headersComplete())
+		return;
+	m_scanPos = m_headerLength;
+	m_bodyLength = 0;
+	m_chunkRemaining = 0;
+	m_state = m_chunked ? CHUNK_SIZE : BODY_IDENTITY;
+}
+
+void RequestFramer::discard(size_t count)
+{
+	m_scanPos = (m_scanPos > count) ? m_scanPos - count : 0;
+	m_headerLength = (m_headerLength > count) ? m_headerLength - count : 0;
+}
+
+void RequestFramer::skipBody(size_t count)
+{
+	if (m_state != BODY_IDENTITY)
+		return;
+	m_bodyLength += std::min(count, m_contentLength - m_bodyLength);
+	if (m_bodyLength == m_contentLength)
+		m_state = DONE;
+}
+
+size_t RequestFramer::scannedLength() const
+{
+	return m_scanPos;
+}
+
+// identity body bytes still to come (0 for chunked bodies, whose end is not known)
+size_t RequestFramer::bodyRemaining() const
+{
+	return (m_state == BODY_IDENTITY) ? m_contentLength - m_bodyLength : 0;
+}
+
+RequestFramer::Result RequestFramer::feed(const std::string &buf, std::string *bodyOut)
+{
+	if (m_state == DONE)
+		return COMPLETE;
+	if (m_state == FAILED)
+		return ERROR;
+
+	if (m_state == HEADERS)
+	{
+		// resume 3 bytes back so a CRLFCRLF split across two reads is still found
+		size_t from = m_scanPos > 3 ? m_scanPos - 3 : 0;
+		size_t hdrEndPos = buf.find("\r\n\r\n", from);
+		if (hdrEndPos == std::string::npos)
+		{
+			m_scanPos = buf.size();
+			if (buf.size() > MAX_HEADER_SIZE)
+				return fail(431);
+			return INCOMPLETE;
+		}
+
+		m_headerLength = hdrEndPos + 4;
+		if (!parseFramingHeaders(buf))
+			return fail(400);
+		if (m_maxBodySize && m_contentLength > m_maxBodySize)
+			return fail(413);
+
+		m_scanPos = m_headerLength;
+		m_state = m_chunked ? CHUNK_SIZE : BODY_IDENTITY;
+	}
+
+	if (m_state == BODY_IDENTITY)
+	{
+		size_t take = std::min(buf.size() - m_scanPos, m_contentLength - m_bodyLength);
+		if (bodyOut)
+			bodyOut->append(buf, m_scanPos, take);
+		m_scanPos += take;
+		m_bodyLength += take;
+		if (m_bodyLength < m_contentLength)
+			return INCOMPLETE;
+		m_state = DONE;
+		return COMPLETE;
+	}
+
+	return scanChunked(buf, bodyOut);
+}
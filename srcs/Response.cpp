@@ -1,5 +1,13 @@
 #include "headers.hpp"
 
+FileBody::FileBody(int fd, off_t offset, size_t length) : fd(fd), offset(offset), length(length) {}
+
+FileBody::~FileBody()
+{
+	if (fd >= 0)
+		::close(fd);
+}
+
 Response::Response()
     : m_statusCode(200),
       m_statusMessage("OK"),
@@ -30,6 +38,14 @@ void Response::setBody(const std::string &body)
 	m_body = body;
 }
 
+// the body is the whole file, sent with sendfile() by the write path
+void Response::setFileBody(const std::shared_ptr<FileBody> &body)
+{
+	m_body.clear();
+	m_fileBody = body;
+	setHeader("Content-Length", std::to_string(body->length));
+}
+
 void Response::setMeta(const std::string &version, const std::string &connection)
 {
 	m_version = version;
@@ -59,29 +75,65 @@ const std::string &Response::getBody() const
 	return m_body;
 }
 
+// moves the body out, for callers that queue it without another copy
+std::string Response::takeBody()
+{
+	return std::move(m_body);
+}
+
+const std::shared_ptr<FileBody> &Response::getFileBody() const
+{
+	return m_fileBody;
+}
+
+/**
+ * Opens a static file for sending. Nothing is shared between workers here:
+ * inside one worker two opens never overlap, and open_file_cache keeps the
+ * fd for the next requests of the same path.
+ * status is 200, 404 (no such path) or 500 (not a readable regular file).
+ */
+static std::shared_ptr<FileBody> openFileBody(const std::string &path, int &status)
+{
+    struct stat st;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+        status = 404;
+        return std::shared_ptr<FileBody>();
+    }
+    if (fd < 0 || ::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0)
+            ::close(fd);
+        status = 500;
+        return std::shared_ptr<FileBody>();
+    }
+
+    std::shared_ptr<FileBody> body = std::make_shared<FileBody>(fd, 0, static_cast<size_t>(st.st_size));
+    body->mtime = st.st_mtime;
+    status = 200;
+    return body;
+}
+
 void Response::loadFile()
 {
-    if (!std::filesystem::exists(m_filePath)) {
+    // the body is not read here: the fd goes to the write path, which sendfile()s it
+    int status = 0;
+    std::shared_ptr<FileBody> body = openFileBody(m_filePath, status);
+    if (status == 404) {
         setStatus(404, "Not Found");
         m_body = "<html><body><h1>404 Not Found</h1></body></html>";
         return;
     }
-
-    std::ifstream file(m_filePath, std::ios::binary);
-    if (!file.is_open()) {
+    if (!body) {
         setStatus(500, "Internal Server Error");
         m_body = "<html><body><h1>500 Internal Server Error</h1></body></html>";
         return;
     }
 
-    std::ostringstream outStream;
-    outStream << file.rdbuf();
-    m_body = outStream.str();
+    setFileBody(body);
 
     if (getStatusCode() == 0)
         setStatus(200, "OK");
 
-    setHeader("Content-Length", std::to_string(m_body.size()));
     if (m_headers.find("Content-Type") == m_headers.end())
         setHeader("Content-Type", "text/html");
 
@@ -89,7 +141,7 @@ void Response::loadFile()
 }
 
 
-std::string Response::serializer()
+std::string Response::serializeHeaders()
 {
     std::ostringstream out;
 
@@ -99,8 +151,9 @@ std::string Response::serializer()
         << getStatusMessage() << "\r\n";
 
 
-    if (m_headers.find("Content-Length") == m_headers.end())
-        m_headers["Content-Length"] = std::to_string(m_body.size());
+    // a chunked body (streamed CGI output) announces no length
+    if (m_headers.find("Content-Length") == m_headers.end() && m_headers.find("Transfer-Encoding") == m_headers.end())
+        m_headers["Content-Length"] = std::to_string(m_fileBody ? m_fileBody->length : m_body.size());
 
     if (m_headers.find("Content-Type") == m_headers.end())
         m_headers["Content-Type"] = "text/html";
@@ -113,54 +166,22 @@ std::string Response::serializer()
         out << key << ": " << value << "\r\n";
 
     out << "\r\n"; 
-    out << m_body; 
 
     return out.str();
 }
 
+// a file body is not part of the string, the caller sends getFileBody() after it
+std::string Response::serializer()
+{
+    return serializeHeaders() + m_body;
+}
+
+// the pages were read at startup (or on SIGHUP), a flood of errors does not touch the disk
 Response Response::fromErrorCode(int code, const Server_struct &server)
 {
     Response res;
     res.setStatus(code, getDefaultMessage(code));
-
-    std::string errorPage;
-    bool useCustomPage = false;
-
-    if (server.error_pages.find(code) != server.error_pages.end())
-    {
-        errorPage = server.error_pages.at(code);
-        std::ifstream file(errorPage.c_str());
-        if (file.is_open())
-        {
-            std::stringstream buffer;
-            buffer << file.rdbuf();
-            res.setBody(buffer.str());
-            file.close();
-            useCustomPage = true;
-        }
-    }
-
-    if (!useCustomPage)
-    {
-        std::string defaultErrorPage = server.root + "/error.html";
-        std::ifstream file(defaultErrorPage.c_str());
-        if (file.is_open())
-        {
-            std::stringstream buffer;
-            buffer << file.rdbuf();
-            res.setBody(buffer.str());
-            file.close();
-            useCustomPage = true;
-        }
-    }
-
-    if (!useCustomPage)
-    {
-        res.setBody("<html><head><title>" + std::to_string(code) + " " + 
-                    getDefaultMessage(code) + "</title></head><body><h1>" + 
-                    std::to_string(code) + " " + getDefaultMessage(code) + 
-                    "</h1></body></html>");
-    }
+    res.setBody(currentErrorPages(server)->body(code));
 
     res.setHeader("Content-Type", "text/html");
     res.setHeader("Content-Length", std::to_string(res.getBody().size()));
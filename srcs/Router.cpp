@@ -5,11 +5,13 @@
 
 
 
-Router::Router(const std::string &docroot, const std::string &uploadsDir, const std::string &index, const Server_struct &serverConfig)
+Router::Router(const std::string &docroot, const std::string &uploadsDir, const std::string &index, const Server_struct &serverConfig,
+               OpenFileCache *openFiles)
     : m_docroot(docroot),
       m_uploads(uploadsDir),
       m_index(index),
-      m_serverConfig(serverConfig)
+      m_serverConfig(serverConfig),
+      m_openFiles(openFiles)
 {
 }
 
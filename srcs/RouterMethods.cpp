@@ -57,27 +57,56 @@ Response Router::handleGET(const std::string &path)
     Response res;
     std::string fullPath = m_docroot + path;
 
+    // a resolution seen before costs no syscall: the cache drops it when anything it looked at changes
+    std::string cacheKey = openFileKey(m_docroot, m_index, path);
+    if (m_openFiles)
+    {
+        if (const OpenFile *file = m_openFiles->find(cacheKey))
+        {
+            if (file->missing)
+                return Response::fromErrorCode(404, m_serverConfig);
+            if (!file->body)
+                return generateDirectoryListing(file->path, path);
+            res.setFileBody(file->body);
+            res.setHeader("Content-Type", file->contentType);
+            return res;
+        }
+    }
+
     std::filesystem::path canonicalFull = std::filesystem::weakly_canonical(fullPath);
     std::filesystem::path canonicalRoot = std::filesystem::weakly_canonical(m_docroot);
 
     if (canonicalFull.string().find(canonicalRoot.string()) != 0)
         return Response::fromErrorCode(403, m_serverConfig);
 
+    std::vector<std::string> looked(1, canonicalFull.string());
     if (!std::filesystem::exists(canonicalFull))
     {
         std::filesystem::path alt = canonicalFull;
         alt += ".html";
+        looked.push_back(alt.string());
         if (std::filesystem::exists(alt))
             canonicalFull = alt;
         else
+        {
+            // scanners ask for the same missing paths over and over
+            if (m_openFiles)
+            {
+                OpenFile missing;
+                missing.missing = true;
+                missing.path = canonicalFull.string();
+                m_openFiles->store(cacheKey, missing, canonicalRoot.string(), looked);
+            }
             return Response::fromErrorCode(404, m_serverConfig);
+        }
     }
 
- 
+    OpenFile file;
     if (std::filesystem::is_directory(canonicalFull))
     {
         std::filesystem::path indexPath = canonicalFull / (m_index.empty() ? "index.html" : m_index);
-        
+        looked.push_back(indexPath.string());
+
         if (std::filesystem::exists(indexPath))
         {
       
@@ -85,7 +114,11 @@ Response Router::handleGET(const std::string &path)
         }
         else
         {
-
+            if (m_openFiles)
+            {
+                file.path = canonicalFull.string();
+                m_openFiles->store(cacheKey, file, canonicalRoot.string(), looked);
+            }
             return generateDirectoryListing(canonicalFull.string(), path);
         }
     }
@@ -94,8 +127,15 @@ Response Router::handleGET(const std::string &path)
     res.loadFile();
 
     res.setHeader("Content-Type", getContentType(canonicalFull.string()));
-    res.setHeader("Content-Length", std::to_string(res.getBody().size()));
 
+    if (m_openFiles && res.getFileBody())
+    {
+        file.body = res.getFileBody();
+        file.path = canonicalFull.string();
+        file.mtime = file.body->mtime;
+        file.contentType = getContentType(canonicalFull.string());
+        m_openFiles->store(cacheKey, file, canonicalRoot.string(), looked);
+    }
     return res;
 }
 
@@ -219,16 +259,14 @@ std::string Router::formatFileSize(std::uintmax_t bytes)
     return oss.str();
 }
 
-Response Router::handlePOST(const Request &req)
+int Router::resolveUploadTarget(const Request &req, std::filesystem::path &target)
 {
-    Response res;
-
     std::string contentLength = req.getHeader("Content-Length");
     if (contentLength.empty() && req.getHeader("Transfer-Encoding") != "chunked")
-        return Response::fromErrorCode(411, m_serverConfig);
+        return 411;
 
-    if (!contentLength.empty() && std::stoi(contentLength) > 100 * MB)
-        return Response::fromErrorCode(413, m_serverConfig);
+    if (!contentLength.empty() && std::stoul(contentLength) > 100 * MB)
+        return 413;
 
     std::string name = extractNameFromPath(req.getPath());
     if (name.empty())
@@ -245,10 +283,33 @@ Response Router::handlePOST(const Request &req)
     std::filesystem::path outp = base / name;
     std::filesystem::path canonicalOut = std::filesystem::weakly_canonical(outp);
     if (canonicalOut.string().find(base.string()) != 0)
-        return Response::fromErrorCode(403, m_serverConfig);
+        return 403;
 
     if (std::filesystem::exists(canonicalOut))
-        return Response::fromErrorCode(409, m_serverConfig);
+        return 409;
+
+    target = canonicalOut;
+    return 0;
+}
+
+Response Router::createdResponse()
+{
+    Response res;
+    std::string okBody = "Created\n";
+
+    res.setStatus(201, "Created");
+    res.setHeader("Content-Type", "text/plain");
+    res.setHeader("Content-Length", std::to_string(okBody.size()));
+    res.setBody(okBody);
+    return res;
+}
+
+Response Router::handlePOST(const Request &req)
+{
+    std::filesystem::path canonicalOut;
+    int errorCode = resolveUploadTarget(req, canonicalOut);
+    if (errorCode)
+        return Response::fromErrorCode(errorCode, m_serverConfig);
 
     std::string body;
     if (req.getHeader("Transfer-Encoding") == "chunked")
@@ -262,13 +323,7 @@ Response Router::handlePOST(const Request &req)
     out.write(body.data(), body.size());
     out.close();
 
-    std::string okBody = "Created\n";
-    res.setStatus(201, "Created");
-    res.setHeader("Content-Type", "text/plain");
-    res.setHeader("Content-Length", std::to_string(okBody.size()));
-    res.setBody(okBody);
-
-    return res;
+    return createdResponse();
 }
 
 Response Router::handleDELETE(const std::string &path)
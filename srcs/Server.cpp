@@ -1,7 +1,25 @@
 #include "headers.hpp"
 
-Server::Server(const Config_struct &cfg) : m_config(cfg) {}
-Server::Server() {}
+Server::Server(const Config_struct &cfg) : m_config(std::make_shared<const Config_struct>(cfg)), m_workerId(0) {}
+Server::Server(std::shared_ptr<const Config_struct> cfg, int workerId) : m_config(cfg), m_workerId(workerId) {}
+Server::Server() : m_config(std::make_shared<const Config_struct>()), m_workerId(0) {}
+
+// request bodies above this size (or chunked) are streamed to disk by the upload handler
+static const size_t UPLOAD_STREAM_THRESHOLD = 64 * 1024;
+
+// largest file range handed to one sendfile() call
+static const size_t SENDFILE_SLICE = 1024 * 1024;
+
+// set by SIGHUP, taken by the first worker to wake up
+static std::atomic<bool> g_reloadRequested(false);
+
+static void requestReload(int)
+{
+	g_reloadRequested = true;
+}
+
+// in-memory slices gathered into one sendmsg() call
+static const size_t MAX_IOVECS = 64;
 
 static const Location_struct *matchLocation(const Server_struct &server, const std::string &path)
 {
@@ -23,9 +41,10 @@ static const Location_struct *matchLocation(const Server_struct &server, const s
 	return bestMatch;
 }
 
-static int create_listener(uint16_t port)
+static int create_listener(uint16_t port, bool reusePort)
 {
-	int listenerFd = ::socket(AF_INET, SOCK_STREAM, 0);
+	// close-on-exec: CGI scripts and the zygote must not hold the port or client sockets open
+	int listenerFd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (listenerFd < 0)
 	{
 		perror("socket");
@@ -39,6 +58,13 @@ static int create_listener(uint16_t port)
 		std::exit(1);
 	}
 
+	// every worker binds its own socket on the port and the kernel balances accepted connections
+	if (reusePort && ::setsockopt(listenerFd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+	{
+		perror("setsockopt(SO_REUSEPORT)");
+		std::exit(1);
+	}
+
 	int flags = ::fcntl(listenerFd, F_GETFL, 0);
 	if (flags < 0 || ::fcntl(listenerFd, F_SETFL, flags | O_NONBLOCK) < 0)
 	{
@@ -90,138 +116,368 @@ std::string Server::readFile(const std::string &filename)
 	return buffer.str();
 }
 
-static std::string GetHeaderValueCI(const std::string &headers, const std::string &name)
+static bool clientWantsKeepAlive(const Request &request)
 {
-	std::istringstream iss(headers);
-	std::string line;
-	std::string low = name;
+	std::string connection = request.getConnectionType();
 
-	while (std::getline(iss, line))
-	{
-		if (line == "\r")
-			break;
+	if (request.getVersion() == "HTTP/1.0")
+		return connection == "keep-alive";
+	return connection != "close";
+}
 
-		size_t colon = line.find(':');
-		if (colon == std::string::npos)
-			continue;
+bool Server::shouldKeepAlive(const Connection &conn, const Request &request, int status)
+{
+	const std::set<int> mustClose = {400, 408, 413, 500};
 
-		std::string key = line.substr(0, colon);
-		for (size_t i = 0; i < key.size(); ++i)
-			key[i] = std::tolower(key[i]);
+	if (mustClose.count(status) || conn.server->keepalive_timeout <= 0)
+		return false;
+	// answered while its body is still arriving: the rest of it is never read
+	if (conn.bodyRouted)
+		return false;
+	if (conn.requestCount >= conn.server->keepalive_requests)
+		return false;
+	return clientWantsKeepAlive(request);
+}
 
-		if (key == low)
-		{
-			std::string val = line.substr(colon + 1);
-			size_t startIndexOfLength = val.find_first_not_of(" \t");
-			size_t endIndexOfLength = val.find_last_not_of(" \t\r\n");
-
-			if (startIndexOfLength == std::string::npos)
-				return "";
-			else
-				return val.substr(startIndexOfLength, endIndexOfLength - startIndexOfLength + 1);
-		}
+static void setConnectionHeaders(Connection &conn, Response &res, bool keepAlive)
+{
+	if (keepAlive)
+	{
+		res.setHeader("Connection", "keep-alive");
+		res.setHeader("Keep-Alive", "timeout=" + std::to_string(conn.server->keepalive_timeout));
+	}
+	else
+	{
+		res.setHeader("Connection", "close");
+		conn.closeAfterWrite = true;
 	}
-	return "";
 }
 
-static bool IsChunkedRequestComplete(const std::string &inbuf, size_t bodyStartPos)
+// what, besides the file, a serialized static answer depends on
+static std::string responseVariant(const Connection &conn, const Request &request, bool keepAlive)
+{
+	if (!keepAlive)
+		return request.getVersion() + " close";
+	return request.getVersion() + " keep-alive " + std::to_string(conn.server->keepalive_timeout);
+}
+
+void Server::queueResponse(Connection &conn, Response &res, bool keepAlive)
 {
-	const std::string body = inbuf.substr(bodyStartPos);
-	return (body.find("0\r\n\r\n") != std::string::npos);
+	setConnectionHeaders(conn, res, keepAlive);
+
+	// pipelined responses are appended in request order and leave together; the body is moved, not copied
+	conn.output.emplace_back();
+	conn.output.back().bytes = res.serializeHeaders();
+	if (res.getFileBody())
+	{
+		conn.output.emplace_back();
+		conn.output.back().file = res.getFileBody();
+	}
+	else if (!res.getBody().empty())
+	{
+		conn.output.emplace_back();
+		conn.output.back().bytes = res.takeBody();
+	}
 }
 
-static bool HTTP_IsRequestComplete(const std::string &inbuf)
+/**
+ * A static GET seen before may already have its whole answer serialized:
+ * then queueing that shared buffer is all there is to do, no routing, no
+ * headers built, no file touched.
+ */
+bool Server::queueCachedResponse(Connection &conn, const Request &request, const std::string &fileKey)
 {
-	size_t hdrEndPos = inbuf.find("\r\n\r\n");
-	if (hdrEndPos == std::string::npos)
+	bool keepAlive = shouldKeepAlive(conn, request, 200);
+	std::shared_ptr<const std::string> bytes = m_openFiles.findResponse(fileKey, responseVariant(conn, request, keepAlive));
+	if (!bytes)
 		return false;
 
-	const std::string allHeaders = inbuf.substr(0, hdrEndPos + 4);
-	const std::string contentLengthValue = GetHeaderValueCI(allHeaders, "content-length");
+	if (!keepAlive)
+		conn.closeAfterWrite = true;
+	conn.output.emplace_back();
+	conn.output.back().share(bytes);
+	return true;
+}
 
-	if (contentLengthValue.empty())
+/**
+ * Queues the answer to a static GET. A small file asked for again is read
+ * once into a buffer behind its headers, which open_file_cache keeps for
+ * queueCachedResponse().
+ */
+void Server::queueStaticResponse(Connection &conn, const Request &request, const std::string &fileKey, Response &res)
+{
+	bool keepAlive = shouldKeepAlive(conn, request, res.getStatusCode());
+	std::shared_ptr<FileBody> file = res.getFileBody();
+	if (res.getStatusCode() != 200 || !file || !m_openFiles.wantsResponse(fileKey, file->length))
 	{
-		const std::string transferEncodingValue = GetHeaderValueCI(allHeaders, "transfer-encoding");
-		if (transferEncodingValue == "chunked")
-			return (IsChunkedRequestComplete(inbuf, hdrEndPos + 4));
-		return true;
+		queueResponse(conn, res, keepAlive);
+		return;
 	}
 
-	size_t needBody = static_cast<size_t>(std::strtoul(contentLengthValue.c_str(), NULL, 10));
-	size_t haveBody;
-	const size_t END_OF_HEADERS = hdrEndPos + 4;
+	setConnectionHeaders(conn, res, keepAlive);
+	std::string bytes = res.serializeHeaders();
+	size_t head = bytes.size();
+	bytes.resize(head + file->length);
+	size_t done = 0;
+	while (done < file->length)
+	{
+		ssize_t n = ::pread(file->fd, &bytes[head + done], file->length - done, file->offset + static_cast<off_t>(done));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += static_cast<size_t>(n);
+	}
 
-	if (inbuf.size() >= END_OF_HEADERS)
-		haveBody = inbuf.size() - END_OF_HEADERS;
-	else
-		haveBody = 0;
+	// the file shrank since it was opened: send what sendfile() finds, keep nothing
+	if (done < file->length)
+	{
+		bytes.resize(head);
+		conn.output.emplace_back();
+		conn.output.back().bytes.swap(bytes);
+		conn.output.emplace_back();
+		conn.output.back().file = file;
+		return;
+	}
+
+	std::shared_ptr<const std::string> shared = std::make_shared<const std::string>(std::move(bytes));
+	m_openFiles.storeResponse(fileKey, responseVariant(conn, request, keepAlive), shared);
+	conn.output.emplace_back();
+	conn.output.back().share(shared);
+}
 
-	return (haveBody >= needBody);
+static bool acceptsGzip(const Request &request)
+{
+	std::string accepted = stringToLower(request.getHeader("Accept-Encoding"));
+	size_t pos = accepted.find("gzip");
+	if (pos == std::string::npos)
+		return false;
+	std::string rest = accepted.substr(pos + 4, accepted.find(',', pos) - pos - 4);
+	rest.erase(std::remove(rest.begin(), rest.end(), ' '), rest.end());
+	return rest != ";q=0" && rest != ";q=0.0";
 }
 
-void Server::sendError(int client_fd, int code, const Server_struct &server)
+/**
+ * If-None-Match holds "*" or a comma separated list of ETags; it uses the
+ * weak comparison, so a W/ prefix is ignored. Only whole entries match.
+ */
+static bool etagMatches(const std::string &ifNoneMatch, const std::string &etag)
 {
-	Response res = Response::fromErrorCode(code, server);
-	std::string msg = res.serializer();
-	m_outbuf[client_fd] = msg;
+	std::istringstream list(ifNoneMatch);
+	std::string entry;
+	while (std::getline(list, entry, ','))
+	{
+		size_t first = entry.find_first_not_of(" \t");
+		if (first == std::string::npos)
+			continue;
+		entry = entry.substr(first, entry.find_last_not_of(" \t") - first + 1);
+		if (entry.compare(0, 2, "W/") == 0)
+			entry.erase(0, 2);
+		if (entry == "*" || entry == etag)
+			return true;
+	}
+	return false;
+}
 
-	for (size_t j = 0; j < m_fds.size(); ++j)
+/**
+ * Answers a GET from the location's asset pack. Only the headers are built
+ * here, the body goes out straight from the mapping; what the pack does
+ * not hold is a 404, the docroot is not looked at.
+ */
+void Server::queuePackResponse(Connection &conn, const Request &request, const std::shared_ptr<const AssetPack> &pack)
+{
+	std::string path = request.getPath().substr(0, request.getPath().find('?'));
+	AssetPack::Asset asset;
+	if (!pack->find(path, asset))
 	{
-		if (m_fds[j].fd == client_fd)
+		sendError(conn.fd, 404, *conn.server, shouldKeepAlive(conn, request, 404));
+		return;
+	}
+
+	Response res;
+	const char *body = asset.data;
+	size_t length = asset.length;
+	const std::string *etag = &asset.etag;
+	if (asset.gzip)
+	{
+		res.setHeader("Vary", "Accept-Encoding");
+		if (acceptsGzip(request))
 		{
-			m_fds[j].events = POLLIN | POLLOUT;
-			break;
+			res.setHeader("Content-Encoding", "gzip");
+			body = asset.gzip;
+			length = asset.gzipLength;
+			etag = &asset.gzipEtag;
 		}
 	}
+	res.setHeader("Content-Type", asset.contentType);
+	res.setHeader("Content-Length", std::to_string(length));
+	res.setHeader("ETag", *etag);
+
+	bool notModified = etagMatches(request.getHeader("If-None-Match"), *etag);
+	if (notModified)
+		res.setStatus(304, "Not Modified");
+	setConnectionHeaders(conn, res, shouldKeepAlive(conn, request, res.getStatusCode()));
+
+	conn.output.emplace_back();
+	conn.output.back().bytes = res.serializeHeaders();
+	if (!notModified && length)
+	{
+		conn.output.emplace_back();
+		conn.output.back().share(pack, body, length);
+	}
+}
+
+void Server::sendError(int client_fd, int code, const Server_struct &server, bool keepAlive)
+{
+	Connection *conn = findConnection(client_fd);
+	if (!conn)
+		return;
+
+	// the answer was serialized when the pages were loaded
+	std::shared_ptr<const std::string> bytes = currentErrorPages(server)->response(code, keepAlive);
+	if (!bytes)
+	{
+		Response res = Response::fromErrorCode(code, server);
+		queueResponse(*conn, res, keepAlive);
+		return;
+	}
+
+	if (!keepAlive)
+		conn->closeAfterWrite = true;
+	conn->output.emplace_back();
+	conn->output.back().share(bytes);
+}
+
+Connection *Server::findConnection(int fd)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= m_connections.size() || !m_connections[fd].isOpen())
+		return NULL;
+	return &m_connections[fd];
+}
+
+void Server::setInterest(Connection &conn, unsigned interest)
+{
+	if (conn.interest == interest)
+		return;
+	if (m_loop->modify(conn.fd, interest))
+		conn.interest = interest;
+}
+
+void Server::closeClientConnection(Connection &conn)
+{
+	if (conn.cgi)
+		releaseCgi(conn);
+	m_loop->remove(conn.fd);
+	m_timers.cancel(conn.fd);
+	::close(conn.fd);
+	conn.reset();
+}
+
+void Server::armTimer(Connection &conn, TimerKind kind, int seconds)
+{
+	conn.timerKind = kind;
+	m_timers.schedule(conn.fd, TimerWheel::monotonicMs() + static_cast<uint64_t>(seconds) * 1000);
+}
+
+/**
+ * Header deadline runs from the first byte of a request and is never pushed
+ * back (a slowloris client cannot keep it alive by trickling), the body
+ * deadline is the longest allowed gap between two reads.
+ */
+void Server::armRequestTimer(Connection &conn)
+{
+	if (conn.inbuf.empty() && !conn.upload)
+		return;
+	if (conn.framer.headersComplete())
+		armTimer(conn, TIMER_BODY, conn.server->client_body_timeout);
+	else if (conn.timerKind != TIMER_HEADER)
+		armTimer(conn, TIMER_HEADER, conn.server->client_header_timeout);
 }
 
-void Server::closeClientConnection(int client_fd, size_t &index)
+void Server::handleExpiredTimers()
 {
-	::close(client_fd);
-	m_clientOrigin.erase(client_fd);
-	m_inbuf.erase(client_fd);
-	m_outbuf.erase(client_fd);
-	m_fds.erase(m_fds.begin() + index);
-	--index;
+	m_expired.clear();
+	m_timers.advance(TimerWheel::monotonicMs(), m_expired);
+
+	for (size_t i = 0; i < m_expired.size(); ++i)
+	{
+		// a FastCGI socket whose application ignored an abort past its deadline
+		std::unordered_map<int, FastCgiConnection *>::iterator fastCgi = m_fastCgiFds.find(m_expired[i]);
+		if (fastCgi != m_fastCgiFds.end())
+		{
+			closeFastCgiConnection(*fastCgi->second);
+			continue;
+		}
+
+		Connection *conn = findConnection(m_expired[i]);
+		if (!conn)
+			continue;
+
+		TimerKind kind = conn->timerKind;
+		conn->timerKind = TIMER_NONE;
+
+		if (kind == TIMER_CGI && conn->cgi)
+		{
+			handleCgiTimeout(*conn);
+			continue;
+		}
+
+		if ((kind == TIMER_HEADER || kind == TIMER_BODY) && (!conn->inbuf.empty() || conn->upload) && !conn->hasOutput())
+		{
+			conn->inbuf.clear();
+			conn->upload.reset();
+			sendError(conn->fd, 408, *conn->server);
+			handleClientWrite(*conn);
+			continue;
+		}
+		closeClientConnection(*conn);
+	}
 }
 
 void Server::initializeListeners()
 {
-	for (size_t i = 0; i < m_config.servers.size(); ++i)
+	bool reusePort = m_config->worker_threads > 1;
+
+	for (size_t i = 0; i < m_config->servers.size(); ++i)
 	{
-		uint16_t port = static_cast<uint16_t>(m_config.servers[i].listen_port);
+		uint16_t port = static_cast<uint16_t>(m_config->servers[i].listen_port);
 		
 		if (m_seen.count(port))
 			continue;
 
 		m_seen.insert(port);
-		int listenerFd = create_listener(port);
+		int listenerFd = create_listener(port, reusePort);
 		m_listenerFdSet.insert(listenerFd);
 		m_portToFd[port] = listenerFd;
 		m_fdToPort[listenerFd] = port;
-		m_fds.push_back({listenerFd, POLLIN, 0});
+		m_loop->add(listenerFd, EventLoop::EV_READ);
 
-		std::cout << "Listening on http://localhost:" << port << "/\n";
+		if (m_workerId == 0)
+			std::cout << "Listening on http://localhost:" << port << "/\n";
 	}
 }
 
-void Server::handlePollError(struct pollfd &pfd, size_t &index)
+void Server::handlePollError(int fd)
 {
-	if (!m_listenerFdSet.count(pfd.fd))
+	if (!m_listenerFdSet.count(fd))
 	{
-		closeClientConnection(pfd.fd, index);
+		Connection *conn = findConnection(fd);
+		if (conn)
+			closeClientConnection(*conn);
 	}
 	else
 	{
-		std::cout << "Ignoring POLLERR/POLLHUP for listener fd=" << pfd.fd << std::endl;
+		std::cout << "Ignoring POLLERR/POLLHUP for listener fd=" << fd << std::endl;
 	}
 }
 
 void Server::acceptNewConnections(int listenerFd)
 {
+	const Server_struct *server = findServerByPort(*m_config, m_fdToPort[listenerFd]);
+
 	while (true)
 	{
-		int newClientFd = ::accept(listenerFd, NULL, NULL);
+		int newClientFd = ::accept4(listenerFd, NULL, NULL, SOCK_CLOEXEC);
 		
 		if (newClientFd < 0)
 		{
@@ -239,60 +495,192 @@ void Server::acceptNewConnections(int listenerFd)
 			continue;
 		}
 
-		m_fds.push_back({newClientFd, POLLIN | POLLOUT, 0});
-		m_clientOrigin[newClientFd] = listenerFd;
+		if (!m_loop->add(newClientFd, EventLoop::EV_READ))
+		{
+			::close(newClientFd);
+			continue;
+		}
+
+		// the kernel hands out the lowest free fd, so the slab stays dense
+		if (static_cast<size_t>(newClientFd) >= m_connections.size())
+			m_connections.resize(newClientFd + 1);
+
+		Connection &conn = m_connections[newClientFd];
+		conn.fd = newClientFd;
+		conn.listenerFd = listenerFd;
+		conn.server = server;
+		conn.interest = EventLoop::EV_READ;
+		conn.framer.setMaxBodySize(server->client_max_body_size);
+		armTimer(conn, TIMER_HEADER, server->client_header_timeout);
 	}
 }
 
-void Server::handleClientWrite(struct pollfd &pfd, size_t &index)
+/**
+ * Drops the slices a write has fully sent and moves the offset of the one
+ * it stopped in.
+ */
+static void consumeOutput(Connection &conn, size_t sent)
 {
-	if (!m_outbuf.count(pfd.fd))
+	while (sent > 0 && conn.hasOutput())
+	{
+		OutputSlice &front = conn.output.front();
+		size_t take = std::min(sent, front.remaining());
+		front.sent += take;
+		sent -= take;
+		if (!front.remaining())
+			conn.output.pop_front();
+	}
+}
+
+void Server::handleClientWrite(Connection &conn)
+{
+	if (!conn.hasOutput())
 		return;
 
-	std::string &outData = m_outbuf[pfd.fd];
+	bool progressed = false;
 
-	if (outData.empty())
-		return;
+	// write until the socket would block: edge-triggered epoll needs it, and level-triggered saves a wakeup
+	while (conn.hasOutput())
+	{
+		OutputSlice &front = conn.output.front();
+		if (!front.remaining())
+		{
+			conn.output.pop_front();
+			continue;
+		}
+
+		ssize_t sent;
+		if (front.file)
+		{
+			// file bodies go from the page cache to the socket without passing through user space
+			size_t wanted = std::min(front.remaining(), SENDFILE_SLICE);
+			off_t offset = front.file->offset + static_cast<off_t>(front.sent);
+			sent = ::sendfile(conn.fd, front.file->fd, &offset, wanted);
+			if (sent == 0)
+			{
+				// the file shrank under us, the promised Content-Length can no longer be met
+				closeClientConnection(conn);
+				return;
+			}
+		}
+		else
+		{
+			// every in-memory slice up to the next file range leaves in one call
+			struct iovec iov[MAX_IOVECS];
+			size_t count = 0;
+			bool moreFollows = false;
+			for (size_t i = 0; i < conn.output.size(); ++i)
+			{
+				OutputSlice &slice = conn.output[i];
+				if (!slice.remaining())
+					continue;
+				if (slice.file || count == MAX_IOVECS)
+				{
+					moreFollows = true;
+					break;
+				}
+				iov[count].iov_base = const_cast<char *>(slice.data()) + slice.sent;
+				iov[count].iov_len = slice.remaining();
+				count++;
+			}
 
-	ssize_t sent = ::send(pfd.fd, outData.c_str(), outData.size(), 0);
-	
-	if (sent < 0)
+			// MSG_MORE holds the headers back until the file data that follows can share their segment
+			struct msghdr msg;
+			std::memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = count;
+			sent = ::sendmsg(conn.fd, &msg, MSG_NOSIGNAL | (moreFollows ? MSG_MORE : 0));
+		}
+
+		if (sent < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			perror(front.file ? "sendfile" : "sendmsg");
+			closeClientConnection(conn);
+			return;
+		}
+
+		consumeOutput(conn, static_cast<size_t>(sent));
+		progressed = true;
+	}
+
+	if (conn.cgi && conn.cgi->outputPaused)
 	{
-		perror("send");
-		closeClientConnection(pfd.fd, index);
+		resumeCgiOutput(conn);
+		if (!conn.isOpen())
+			return;
+	}
+
+	// stop reading until the queued responses are out, new requests wait in the socket buffer
+	if (conn.hasOutput())
+	{
+		if (conn.cgi)
+			updateCgiInterest(conn);
+		else
+			setInterest(conn, EventLoop::EV_WRITE);
+		if (progressed || conn.timerKind != TIMER_SEND)
+			armTimer(conn, TIMER_SEND, conn.server->send_timeout);
 		return;
 	}
 
-	if (sent > 0)
+	// a CGI answer is still being produced: stay quiet until it is queued
+	if (conn.cgi)
 	{
-		outData.erase(0, sent);
+		updateCgiInterest(conn);
+		armCgiTimer(conn);
+		return;
+	}
 
-		if (outData.empty())
-		{
-			m_outbuf.erase(pfd.fd);
-			closeClientConnection(pfd.fd, index);
-		}
+	if (conn.closeAfterWrite)
+	{
+		closeClientConnection(conn);
+		return;
 	}
+
+	// persistent connection: wait for the next request on the same socket
+	setInterest(conn, EventLoop::EV_READ);
+	if (conn.inbuf.empty())
+		armTimer(conn, TIMER_KEEPALIVE, conn.server->keepalive_timeout);
+	else
+		armTimer(conn, TIMER_HEADER, conn.server->client_header_timeout);
 }
 
-bool Server::readClientData(int client_fd)
+bool Server::readClientData(Connection &conn, bool &peerClosed)
 {
 	char buffer[4096];
-	ssize_t recvRet = ::recv(client_fd, buffer, sizeof(buffer), 0);
+	bool gotData = false;
 
-	if (recvRet < 0)
+	peerClosed = false;
+	while (true)
 	{
-		perror("recv");
-		return false;
-	}
+		ssize_t recvRet = ::recv(conn.fd, buffer, sizeof(buffer), 0);
 
-	if (recvRet == 0)
-		return false;
+		if (recvRet < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			if (errno == EINTR)
+				continue;
+			perror("recv");
+			return false;
+		}
 
-	if (recvRet > 0)
-		m_inbuf[client_fd].append(buffer, recvRet);
+		if (recvRet == 0)
+		{
+			peerClosed = true;
+			return gotData;
+		}
 
-	return true;
+		conn.inbuf.append(buffer, recvRet);
+		gotData = true;
+
+		// level-triggered backends report the rest on the next wait
+		if (!m_loop->isEdgeTriggered())
+			return true;
+	}
 }
 
 void Server::setLocationDefaults(const Server_struct &server, 
@@ -332,11 +720,14 @@ bool Server::checkCgiRequest(const Request &request,
 	cgiExtension = location->cgi_extension;
 	cgiInterpreterPath = location->cgi_path;
 
-	if (request.getPath().size() >= cgiExtension.size() &&
-		request.getPath().rfind(cgiExtension) == request.getPath().size() - cgiExtension.size())
+	// the query string goes to the script, it is not part of its name
+	std::string path = request.getPath().substr(0, request.getPath().find('?'));
+
+	if (path.size() >= cgiExtension.size() &&
+		path.rfind(cgiExtension) == path.size() - cgiExtension.size())
 		return true;
 
-	if (request.getPath() == location->path && !location->index.empty())
+	if (path == location->path && !location->index.empty())
 		return true;
 
 	return false;
@@ -347,7 +738,7 @@ std::string Server::buildScriptPath(const Request &request,
 									  const std::string &docroot,
 									  const std::string &indexName)
 {
-	std::string targetPath = request.getPath();
+	std::string targetPath = request.getPath().substr(0, request.getPath().find('?'));
 
 	if (targetPath == location->path || targetPath.back() == '/')
 	{
@@ -366,9 +757,10 @@ std::string Server::buildScriptPath(const Request &request,
 	return scriptPath.string();
 }
 
-bool Server::validateScriptPath(const std::string &scriptPath, const std::string &docroot)
+// a script run by a FastCGI application only has to exist, it is not executed directly
+bool Server::validateScriptPath(const std::string &scriptPath, const std::string &docroot, bool needExec)
 {
-	if (::access(scriptPath.c_str(), F_OK | X_OK) != 0)
+	if (::access(scriptPath.c_str(), needExec ? (F_OK | X_OK) : F_OK) != 0)
 		return false;
 
 	auto canonicalDocRoot = std::filesystem::weakly_canonical(docroot);
@@ -378,56 +770,246 @@ bool Server::validateScriptPath(const std::string &scriptPath, const std::string
 	return true;
 }
 
-void Server::handleCgiRequest(int client_fd,
-							   const Request &request,
-							   const std::string &scriptPath,
-							   const std::string &cgiInterpreterPath)
+static std::string multipartBoundary(const Request &request)
 {
-	CgiResult cg = runCgi(request, scriptPath, cgiInterpreterPath);
-	cg.headers.clear();
-	cg.headers["content-type"] = "text/html";
+	std::string ctype = request.getHeader("Content-Type");
+	if (stringToLower(ctype).find("multipart/form-data") == std::string::npos)
+		return "";
 
-	Response res;
-	int status = cg.status ? cg.status : 200;
-	res.setStatus(status, reasonPhrase(status));
+	size_t pos = ctype.find("boundary=");
+	if (pos == std::string::npos)
+		return "";
+	std::string b = ctype.substr(pos + 9);
+	if (!b.empty() && b.front() == '"')
+		b.erase(0, 1);
+	if (!b.empty() && b.back() == '"')
+		b.pop_back();
+	return b;
+}
+
+/**
+ * Called once the head of a request is in but its body is not: a large POST
+ * for the upload handler is written to a temp file as it arrives instead of
+ * being collected in inbuf. Returns false when the request should go the
+ * buffered way, true when streaming started or an error was queued.
+ */
+bool Server::startUploadStream(Connection &conn)
+{
+	if (!conn.framer.isChunked() && conn.framer.contentLength() <= UPLOAD_STREAM_THRESHOLD)
+		return false;
+
+	Request request;
+	try
+	{
+		RequestParser parser;
+		request = parser.parse(conn.inbuf.substr(0, conn.framer.headerLength()));
+	}
+	catch (const std::exception &)
+	{
+		return false;
+	}
+	if (request.getMethod() != "POST")
+		return false;
+
+	const Location_struct *matchedLocation = matchLocation(*conn.server, request.getPath());
+	std::string docroot, uploadDir, indexName;
+	setLocationDefaults(*conn.server, matchedLocation, docroot, uploadDir, indexName);
+
+	std::string cgiExtension, cgiInterpreterPath;
+	if (checkCgiRequest(request, matchedLocation, cgiExtension, cgiInterpreterPath))
+		return false;
+
+	Router router(docroot, uploadDir, indexName, *conn.server);
+	if (!router.isMethodAllowed("POST", request.getPath()))
+		return false;
+
+	conn.requestCount++;
+
+	// the rest of the body is still on the wire, so an early error also ends the connection
+	std::filesystem::path target;
+	int errorCode = router.resolveUploadTarget(request, target);
+	if (errorCode)
+	{
+		sendError(conn.fd, errorCode, *conn.server);
+		return true;
+	}
+
+	std::string boundary;
+	if (!conn.framer.isChunked())
+		boundary = multipartBoundary(request);
+
+	conn.upload.reset(new UploadStream());
+	if (!conn.upload->open(target.string(), boundary))
+	{
+		conn.upload.reset();
+		sendError(conn.fd, 500, *conn.server);
+		return true;
+	}
+	conn.uploadRequest = request;
+
+	size_t headerLength = conn.framer.headerLength();
+	conn.inbuf.erase(0, headerLength);
+	conn.framer.rewindBody();
+	conn.framer.discard(headerLength);
+	return true;
+}
+
+/**
+ * Moves the body bytes buffered so far into the upload file and drops them
+ * from inbuf. Returns true once the request is finished and answered.
+ */
+bool Server::continueUploadStream(Connection &conn)
+{
+	m_uploadChunk.clear();
+	RequestFramer::Result framed = conn.framer.feed(conn.inbuf, &m_uploadChunk);
+	bool written = m_uploadChunk.empty() || conn.upload->write(m_uploadChunk.data(), m_uploadChunk.size());
+
+	size_t scanned = conn.framer.scannedLength();
+	conn.inbuf.erase(0, scanned);
+	conn.framer.discard(scanned);
+
+	if (framed == RequestFramer::INCOMPLETE && written)
+		return false;
+
+	int status;
+	if (framed == RequestFramer::ERROR)
+		status = conn.framer.errorStatus();
+	else if (!written)
+		status = 500;
+	else
+		status = conn.upload->commit();
+	m_openFiles.handleEvents();
+
+	conn.upload.reset();
+	conn.framer.reset();
+	conn.bodyRouted = false;
+
+	if (framed != RequestFramer::COMPLETE || !written)
+	{
+		sendError(conn.fd, status, *conn.server);
+		return true;
+	}
+
+	Response res = status ? Response::fromErrorCode(status, *conn.server) : Router::createdResponse();
+	int code = status ? status : 201;
+	res.initialize(code, res.getStatusMessage(), conn.uploadRequest);
+	queueResponse(conn, res, shouldKeepAlive(conn, conn.uploadRequest, code));
+	conn.uploadRequest = Request();
+	return true;
+}
+
+/**
+ * The CGI counterpart of startUploadStream(): a script request whose body
+ * is not complete yet is started (or queued for its slot) right away and
+ * its body follows on stdin as it arrives. FastCGI requests, which send
+ * the body along with the request, stay buffered.
+ */
+bool Server::startCgiBodyStream(Connection &conn)
+{
+	Request request;
+	try
+	{
+		RequestParser parser;
+		request = parser.parse(conn.inbuf.substr(0, conn.framer.headerLength()));
+	}
+	catch (const std::exception &)
+	{
+		return false;
+	}
+
+	const Location_struct *matchedLocation = matchLocation(*conn.server, request.getPath());
+	std::string docroot, uploadDir, indexName;
+	setLocationDefaults(*conn.server, matchedLocation, docroot, uploadDir, indexName);
+
+	std::string cgiExtension, cgiInterpreterPath;
+	if (!checkCgiRequest(request, matchedLocation, cgiExtension, cgiInterpreterPath) || !matchedLocation->fastcgi_pass.empty())
+		return false;
+
+	conn.requestCount++;
+
+	// the rest of the body is still on the wire, so an early error also ends the connection
+	std::string scriptPath = buildScriptPath(request, matchedLocation, docroot, indexName);
+	if (!validateScriptPath(scriptPath, docroot))
+	{
+		sendError(conn.fd, (::access(scriptPath.c_str(), F_OK) != 0) ? 404 : 403, *conn.server);
+		return true;
+	}
 
-	for (const auto &kv : cg.headers)
-		res.setHeader(kv.first, kv.second);
+	size_t headerLength = conn.framer.headerLength();
+	conn.inbuf.erase(0, headerLength);
+	conn.framer.rewindBody();
+	conn.framer.discard(headerLength);
 
-	res.setBody(cg.body);
-	m_outbuf[client_fd] = res.serializer();
+	handleCgiRequest(conn, request, scriptPath, *matchedLocation, true);
+	if (conn.cgi)
+		feedCgiBody(conn);
+	return true;
+}
 
-	for (size_t j = 0; j < m_fds.size(); ++j)
+void Server::processBufferedRequests(Connection &conn)
+{
+	while (conn.isOpen() && !conn.closeAfterWrite && !conn.cgi)
 	{
-		if (m_fds[j].fd == client_fd)
+		if (conn.upload)
 		{
-			m_fds[j].events = POLLIN | POLLOUT;
-			break;
+			if (!continueUploadStream(conn))
+				return;
+			continue;
+		}
+
+		RequestFramer::Result framed = conn.framer.feed(conn.inbuf);
+		if (framed == RequestFramer::INCOMPLETE)
+		{
+			if (!conn.bodyRouted && conn.framer.headersComplete())
+			{
+				conn.bodyRouted = true;
+				if (startUploadStream(conn) || startCgiBodyStream(conn))
+					continue;
+			}
+			return;
+		}
+
+		if (framed == RequestFramer::ERROR)
+		{
+			int status = conn.framer.errorStatus();
+			conn.framer.reset();
+			conn.inbuf.clear();
+			sendError(conn.fd, status, *conn.server);
+			return;
 		}
+
+		size_t requestLength = conn.framer.requestLength();
+		conn.framer.reset();
+		conn.bodyRouted = false;
+		processCompleteRequest(conn, requestLength);
 	}
 
-	m_inbuf.erase(client_fd);
+	// nothing after a closing response is ever answered
+	if (conn.closeAfterWrite)
+		conn.inbuf.clear();
 }
 
-void Server::processCompleteRequest(int client_fd, size_t &index)
+void Server::processCompleteRequest(Connection &conn, size_t requestLength)
 {
 	RequestParser parser;
 	Request request;
 
-	int listener_fd = m_clientOrigin[client_fd];
-	uint16_t port = m_fdToPort[listener_fd];
-	const Server_struct *current_server = findServerByPort(m_config, port);
+	const Server_struct *current_server = conn.server;
 
-	if (!current_server)
-	{
-		std::cerr << "ERROR: Could not find server for port " << port << std::endl;
-		closeClientConnection(client_fd, index);
-		return;
-	}
+	conn.requestCount++;
 
 	try
 	{
-		request = parser.parse(m_inbuf[client_fd]);
+		// the usual case is one request per read: take the buffer over instead of copying it
+		std::string rawRequest;
+		if (requestLength == conn.inbuf.size())
+			rawRequest.swap(conn.inbuf);
+		else
+		{
+			rawRequest = conn.inbuf.substr(0, requestLength);
+			conn.inbuf.erase(0, requestLength);
+		}
+		request = parser.parse(rawRequest);
 
 		std::string contentLength = request.getHeader("Content-Length");
 		if (!contentLength.empty())
@@ -435,8 +1017,7 @@ void Server::processCompleteRequest(int client_fd, size_t &index)
 			size_t bodySize = std::strtoul(contentLength.c_str(), NULL, 10);
 			if (bodySize > current_server->client_max_body_size)
 			{
-				sendError(client_fd, 413, *current_server);
-				closeClientConnection(client_fd, index);
+				sendError(conn.fd, 413, *current_server);
 				return;
 			}
 		}
@@ -444,8 +1025,8 @@ void Server::processCompleteRequest(int client_fd, size_t &index)
 	catch (const std::exception &e)
 	{
 		std::cerr << "Parse error: " << e.what() << std::endl;
-		sendError(client_fd, 400, *current_server);
-		closeClientConnection(client_fd, index);
+		conn.inbuf.clear();
+		sendError(conn.fd, 400, *current_server);
 		return;
 	}
 
@@ -462,94 +1043,223 @@ void Server::processCompleteRequest(int client_fd, size_t &index)
 	{
 		std::string scriptPath = buildScriptPath(request, matchedLocation, docroot, indexName);
 
-		if (!validateScriptPath(scriptPath, docroot))
+		if (!validateScriptPath(scriptPath, docroot, matchedLocation->fastcgi_pass.empty()))
 		{
 			int errorCode = (::access(scriptPath.c_str(), F_OK) != 0) ? 404 : 403;
-			sendError(client_fd, errorCode, *current_server);
-			closeClientConnection(client_fd, index);
+			sendError(conn.fd, errorCode, *current_server, shouldKeepAlive(conn, request, errorCode));
 			return;
 		}
 
-		handleCgiRequest(client_fd, request, scriptPath, cgiInterpreterPath);
+		handleCgiRequest(conn, request, scriptPath, *matchedLocation);
 		return;
 	}
 
-	Router router(docroot, uploadDir, indexName, *current_server);
-	Response res = router.handleRequest(request);
-	m_outbuf[client_fd] = res.serializer();
+	if (matchedLocation && matchedLocation->cgi_stats)
+	{
+		queueCgiStats(conn, request);
+		return;
+	}
 
-	for (size_t j = 0; j < m_fds.size(); ++j)
+	const std::shared_ptr<const AssetPack> &pack = matchedLocation ? matchedLocation->pack : current_server->pack;
+	if (pack && request.getMethod() == "GET")
 	{
-		if (m_fds[j].fd == client_fd)
-		{
-			m_fds[j].events = POLLIN | POLLOUT;
-			break;
-		}
+		queuePackResponse(conn, request, pack);
+		return;
 	}
+
+	std::string fileKey = openFileKey(docroot, indexName, requested_path);
+	if (request.getMethod() == "GET" && queueCachedResponse(conn, request, fileKey))
+		return;
+
+	Router router(docroot, uploadDir, indexName, *current_server, &m_openFiles);
+	Response res = router.handleRequest(request);
+	if (request.getMethod() == "GET")
+	{
+		queueStaticResponse(conn, request, fileKey, res);
+		return;
+	}
+	// a request that changed files is seen by the next one, even within this turn of the loop
+	m_openFiles.handleEvents();
+	queueResponse(conn, res, shouldKeepAlive(conn, request, res.getStatusCode()));
 }
 
-void Server::handleClientRead(struct pollfd &pfd, size_t &index)
+void Server::handleClientRead(Connection &conn)
 {
-	if (!readClientData(pfd.fd))
+	bool peerClosed = false;
+
+	if (conn.cgi && conn.cgi->inputOpen)
+	{
+		readCgiBody(conn);
+		return;
+	}
+
+	if (!readClientData(conn, peerClosed))
 	{
-		closeClientConnection(pfd.fd, index);
+		closeClientConnection(conn);
 		return;
 	}
 
-	std::string &rawRequest = m_inbuf[pfd.fd];
-	if (!HTTP_IsRequestComplete(rawRequest))
+	processBufferedRequests(conn);
+	if (!conn.isOpen())
 		return;
 
-	processCompleteRequest(pfd.fd, index);
+	// the client already sent FIN, so answer what is complete and close instead of keeping the socket around
+	if (peerClosed)
+	{
+		if (!conn.hasOutput() && !conn.cgi)
+		{
+			closeClientConnection(conn);
+			return;
+		}
+		conn.closeAfterWrite = true;
+	}
+
+	// one write for every response produced by this read
+	if (conn.hasOutput())
+		handleClientWrite(conn);
+	else if (conn.cgi)
+		updateCgiInterest(conn);
+	else
+		armRequestTimer(conn);
 }
 
 int Server::start_server(void)
 {
-	if (m_config.servers.empty())
+	if (m_config->servers.empty())
 	{
 		std::cerr << "Error: No servers loaded from config.\n";
 		return 1;
 	}
 
+	// a CGI script that exits without reading its stdin must not take the server down
+	::signal(SIGPIPE, SIG_IGN);
+
+	// SIGHUP reads the error pages again; SA_RESTART keeps it from failing blocking calls
+	struct sigaction reload;
+	std::memset(&reload, 0, sizeof(reload));
+	reload.sa_handler = requestReload;
+	reload.sa_flags = SA_RESTART;
+	::sigemptyset(&reload.sa_mask);
+	::sigaction(SIGHUP, &reload, NULL);
+
+	// worker 0 runs on the calling thread, the others get their own Server and share the config read-only
+	std::vector<std::thread> workers;
+	for (int i = 1; i < m_config->worker_threads; ++i)
+	{
+		std::shared_ptr<const Config_struct> config = m_config;
+		workers.emplace_back([config, i]()
+		{
+			Server worker(config, i);
+			worker.runEventLoop();
+		});
+	}
+	if (m_config->worker_threads > 1)
+		std::cout << "Started " << m_config->worker_threads << " worker threads\n";
+
+	runEventLoop();
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	return 0;
+}
+
+void Server::runEventLoop(void)
+{
+	m_loop.reset(new EventLoop(EventLoop::backendFromName(m_config->event_backend)));
 	initializeListeners();
+	// without its events the cache would serve stale files, so it stays off when they cannot be read
+	if (m_config->open_file_cache && (!m_openFiles.enable(m_config->open_file_cache, m_config->open_file_cache_responses)
+									  || !m_loop->add(m_openFiles.fd(), EventLoop::EV_READ)))
+	{
+		perror("open_file_cache");
+		m_openFiles.disable();
+	}
+
+	std::vector<EventLoop::Event> ready;
+	std::vector<int> readyListeners;
 
 	while (true)
 	{
-		int ret = ::poll(m_fds.data(), m_fds.size(), -1);
-		if (ret < 0)
+		// sleep until the next deadline on the timer wheel, or forever when nothing is pending
+		int timeoutMs = m_timers.nextTimeoutMs(TimerWheel::monotonicMs());
+		// killed CGI children are usually gone within a few ms, poll for them instead of blocking in waitpid();
+		// queued CGI requests poll the same way for slots other workers free
+		if ((!m_cgiZombies.empty() || !m_cgiExitPolls.empty() || m_cgiQueued) && (timeoutMs < 0 || timeoutMs > 10))
+			timeoutMs = 10;
+		if (m_loop->wait(timeoutMs, ready) < 0)
 		{
-			perror("poll");
+			perror("event loop wait");
 			std::exit(1);
 		}
 
-		for (size_t i = 0; i < m_fds.size(); ++i)
+		// whichever worker the signal woke does the reload for all of them
+		if (g_reloadRequested.exchange(false))
+			reloadErrorPages(*m_config);
+
+		// accept after serving clients: a reused fd number must not pick up a stale event from this batch
+		readyListeners.clear();
+		for (size_t i = 0; i < ready.size(); ++i)
 		{
-			struct pollfd &pfd = m_fds[i];
+			const EventLoop::Event &ev = ready[i];
 
-			if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+			Connection *conn = findConnection(ev.fd);
+			if (!conn)
 			{
-				handlePollError(pfd, i);
+				if (ev.fd == m_openFiles.fd())
+				{
+					m_openFiles.handleEvents();
+					continue;
+				}
+				if (handleCgiEvent(ev.fd) || handleFastCgiEvent(ev.fd, ev.events) || handleCgiZygoteEvent(ev.fd)
+					|| !m_listenerFdSet.count(ev.fd))
+					continue;
+				if (ev.events & (EventLoop::EV_ERROR | EventLoop::EV_HANGUP))
+					handlePollError(ev.fd);
+				else
+					readyListeners.push_back(ev.fd);
 				continue;
 			}
 
-			if (m_listenerFdSet.count(pfd.fd))
+			if (ev.events & EventLoop::EV_ERROR)
 			{
-				acceptNewConnections(pfd.fd);
+				closeClientConnection(*conn);
 				continue;
 			}
 
-			if ((pfd.revents & POLLOUT) && m_outbuf.count(pfd.fd))
+			// nobody is left to answer: stop the script now rather than at its exit or timeout
+			if (conn->cgi && !conn->cgi->inputOpen && (ev.events & (EventLoop::EV_HANGUP | EventLoop::EV_PEER_CLOSED)))
 			{
-				handleClientWrite(pfd, i);
+				cancelCgi(*conn);
 				continue;
 			}
 
-			if (pfd.revents & POLLIN)
+			if ((ev.events & EventLoop::EV_WRITE) && conn->hasOutput())
+			{
+				handleClientWrite(*conn);
+				// a CGI body still arriving is read in the same turn, edge-triggered epoll would not report it again
+				if (!(ev.events & EventLoop::EV_READ) || !conn->isOpen() || !conn->cgi || !conn->cgi->inputOpen)
+					continue;
+			}
+
+			if (ev.events & (EventLoop::EV_READ | EventLoop::EV_HANGUP))
 			{
-				handleClientRead(pfd, i);
+				handleClientRead(*conn);
 			}
 		}
-	}
 
-	return 0;
-}
\ No newline at end of file
+		for (size_t i = 0; i < readyListeners.size(); ++i)
+			acceptNewConnections(readyListeners[i]);
+		if (!m_cgiRetries.empty())
+			retryCgiWaiters();
+		if (!m_cgiRefreshes.empty())
+			startCgiRefreshes();
+
+		handleExpiredTimers();
+		if (!m_cgiZombies.empty())
+			reapCgiZombies();
+		if (!m_cgiExitPolls.empty())
+			pollCgiExits();
+		if (m_cgiQueued)
+			admitQueuedCgi();
+	}
+}
@@ -0,0 +1,1272 @@
+#include "headers.hpp"
+
+/**
+ * CGI runs inside the event loop: the child's stdin/stdout pipes and its
+ * pidfd are registered next to the client sockets, so a slow script only
+ * delays its own connection. The client is paused (no read interest) while
+ * its script runs, and requests pipelined behind it wait in inbuf.
+ *
+ * A location with cgi_max_concurrent admits that many requests per worker;
+ * the next cgi_queue_size wait in FIFO order (paused like a running one,
+ * their cgi_timeout already counting) and anything beyond gets 503.
+ *
+ * Once the script's header block is complete the response head is queued
+ * and the body follows as the script writes it (chunked unless the script
+ * sent a Content-Length), so the first byte does not wait for the exit.
+ * The same goes the other way: a request body that is not complete when
+ * the head arrives starts the script at once and is fed to its stdin as
+ * it comes in (see startCgiBodyStream()).
+ *
+ * A GET to a cgi_cache location is looked up in the worker's CgiCache
+ * before it takes a slot. A miss runs the script and keeps the answer,
+ * collected whole rather than streamed, when its headers allow it; a stale
+ * hit is served as is while one background request renews it. Misses on a
+ * key whose answer is already being produced wait for that answer.
+ */
+
+// queued client output above which the script's stdout is no longer read, and below which it is again
+static const size_t CGI_STREAM_HIGH_WATER = 256 * 1024;
+static const size_t CGI_STREAM_LOW_WATER = 64 * 1024;
+
+// request body buffered for a script above which the client is no longer read
+static const size_t CGI_INPUT_HIGH_WATER = 256 * 1024;
+
+// largest piece of a request body moved from the client to stdin by one splice()
+static const size_t CGI_SPLICE_SIZE = 64 * 1024;
+
+// answers larger than this are streamed instead of cached
+static const size_t CGI_CACHE_MAX_ENTRY = 1024 * 1024;
+
+static std::unique_ptr<CgiJob> newCgiJob(const Request &request,
+										 const std::string &scriptPath,
+										 const Location_struct &location,
+										 int clientFd)
+{
+	std::unique_ptr<CgiJob> job(new CgiJob());
+	job->clientFd = clientFd;
+	job->deadlineMs = TimerWheel::monotonicMs() + static_cast<uint64_t>(location.cgi_timeout) * 1000;
+	job->request = request;
+	job->input = request.getBody();
+	job->location = &location;
+	job->scriptPath = scriptPath;
+	job->params = buildCgiParams(request, scriptPath, clientFd);
+	return job;
+}
+
+/**
+ * The script's own headers, minus those describing the framing or the
+ * connection, which are ours to set. parseCgiHeaders() lowercased the
+ * names, they go out capitalized so Content-Type replaces the default.
+ */
+static void setCgiHeaders(Response &res, const std::map<std::string, std::string> &headers)
+{
+	for (const auto &kv : headers)
+	{
+		const std::string &key = kv.first;
+		if (key == "content-length" || key == "transfer-encoding" || key == "connection" || key == "keep-alive")
+			continue;
+
+		std::string name = key;
+		bool upper = true;
+		for (size_t i = 0; i < name.size(); ++i)
+		{
+			if (upper)
+				name[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(name[i])));
+			upper = name[i] == '-';
+		}
+		res.setHeader(name, kv.second);
+	}
+}
+// raises count unless it already reached max; the workers share it, hence the compare-exchange
+static bool takeShared(std::atomic<size_t> &count, size_t max)
+{
+	size_t current = count.load();
+	do
+	{
+		if (current >= max)
+			return false;
+	} while (!count.compare_exchange_weak(current, current + 1));
+	return true;
+}
+
+// a running slot of location, counted over every worker
+static bool takeCgiSlot(CgiLocationStats &stats, const Location_struct &location)
+{
+	if (location.cgi_max_concurrent)
+		return takeShared(stats.running, location.cgi_max_concurrent);
+	stats.running++;
+	return true;
+}
+
+void Server::handleCgiRequest(Connection &conn,
+							   const Request &request,
+							   const std::string &scriptPath,
+							   const Location_struct &location,
+							   bool bodyFollows)
+{
+	CgiLimit &limit = m_cgiLimits[&location];
+	if (!limit.stats)
+		limit.stats = &cgiLocationStats(&location);
+
+	std::string cacheKey;
+	if (location.cgi_cache && request.getMethod() == "GET" && !bodyFollows)
+	{
+		cacheKey = cgiCacheKey(request, location);
+		if (serveCgiCache(conn, request, scriptPath, location, cacheKey))
+			return;
+
+		std::unordered_map<std::string, CgiFlight>::iterator flight = m_cgiFlights.find(cacheKey);
+		if (flight != m_cgiFlights.end())
+		{
+			// paused like a running request, the CGI timeout still applies
+			std::unique_ptr<CgiJob> job = newCgiJob(request, scriptPath, location, conn.fd);
+			job->cacheKey = cacheKey;
+			job->waiting = true;
+			flight->second.waiters.push_back(conn.fd);
+			limit.stats->cacheCoalesced++;
+			conn.cgi = std::move(job);
+			armCgiTimer(conn);
+			return;
+		}
+	}
+
+	bool full = !takeCgiSlot(*limit.stats, location);
+	if (full && !takeShared(limit.stats->queued, location.cgi_queue_size))
+	{
+		limit.stats->rejected++;
+		Response res = Response::fromErrorCode(503, *conn.server);
+		res.setHeader("Retry-After", "1");
+		queueResponse(conn, res, shouldKeepAlive(conn, request, 503));
+		return;
+	}
+
+	std::unique_ptr<CgiJob> job = newCgiJob(request, scriptPath, location, conn.fd);
+	job->inputOpen = bodyFollows;
+	job->cacheKey = cacheKey;
+	if (!cacheKey.empty())
+		m_cgiFlights[cacheKey].leader = job.get();
+
+	if (full)
+	{
+		limit.queue.push_back(job.get());
+		m_cgiQueued++;
+	}
+	conn.cgi = std::move(job);
+	armCgiTimer(conn);
+	if (!full)
+		startCgiJob(conn);
+}
+
+// answers from the cgi_cache when it holds the request; a stale answer also asks for its refresh
+bool Server::serveCgiCache(Connection &conn,
+						   const Request &request,
+						   const std::string &scriptPath,
+						   const Location_struct &location,
+						   const std::string &key)
+{
+	CgiLocationStats &stats = *m_cgiLimits[&location].stats;
+	CgiCacheEntry *entry = NULL;
+	time_t now = ::time(NULL);
+	CgiCache::State state = m_cgiCache.lookup(key, now, entry);
+
+	if (state == CgiCache::MISS)
+	{
+		stats.cacheMisses++;
+		return false;
+	}
+
+	Response res;
+	res.setStatus(entry->status, reasonPhrase(entry->status));
+	setCgiHeaders(res, entry->headers);
+	res.setHeader("Age", std::to_string(now - entry->storedAt));
+	res.setHeader("X-Cache", state == CgiCache::FRESH ? "HIT" : "STALE");
+	res.setBody(entry->body);
+	queueResponse(conn, res, shouldKeepAlive(conn, request, entry->status));
+
+	if (state == CgiCache::FRESH)
+	{
+		stats.cacheHits++;
+		return true;
+	}
+	stats.cacheStale++;
+	if (!entry->refreshing)
+	{
+		entry->refreshing = true;
+		std::unique_ptr<CgiJob> job = newCgiJob(request, scriptPath, location, conn.fd);
+		job->cacheKey = key;
+		job->refresh = true;
+		m_cgiRefreshes.push_back(std::move(job));
+	}
+	return true;
+}
+
+/**
+ * Starts the refreshes asked for during this turn of the loop. Each gets
+ * a connection slot of its own, on an fd of /dev/null that is never
+ * polled, so it runs, times out and is released like a client's request.
+ * That slot is only taken here since growing the slab moves the
+ * connections the event handlers hold. A location with no free slot skips
+ * its refresh: the stale answer stays, and the next hit asks again.
+ */
+void Server::startCgiRefreshes()
+{
+	std::vector<std::unique_ptr<CgiJob> > refreshes;
+	refreshes.swap(m_cgiRefreshes);
+
+	for (size_t i = 0; i < refreshes.size(); ++i)
+	{
+		std::unique_ptr<CgiJob> &job = refreshes[i];
+		const Location_struct &location = *job->location;
+		CgiLimit &limit = m_cgiLimits[&location];
+
+		int fd = -1;
+		if (!m_cgiFlights.count(job->cacheKey) && takeCgiSlot(*limit.stats, location))
+		{
+			fd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				limit.stats->running--;
+		}
+		if (fd < 0)
+		{
+			if (CgiCacheEntry *entry = m_cgiCache.find(job->cacheKey))
+				entry->refreshing = false;
+			continue;
+		}
+
+		if (static_cast<size_t>(fd) >= m_connections.size())
+			m_connections.resize(fd + 1);
+		Connection &conn = m_connections[fd];
+		conn.fd = fd;
+		job->clientFd = fd;
+		job->deadlineMs = TimerWheel::monotonicMs() + static_cast<uint64_t>(location.cgi_timeout) * 1000;
+		m_cgiFlights[job->cacheKey].leader = job.get();
+		conn.cgi = std::move(job);
+		armCgiTimer(conn);
+		startCgiJob(conn);
+	}
+}
+
+// the clients waiting for job's answer; the key is no longer in flight once they are taken
+std::vector<int> Server::takeCgiWaiters(CgiJob &job)
+{
+	std::vector<int> waiters;
+	if (job.cacheKey.empty() || job.waiting)
+		return waiters;
+
+	std::unordered_map<std::string, CgiFlight>::iterator flight = m_cgiFlights.find(job.cacheKey);
+	if (flight == m_cgiFlights.end() || flight->second.leader != &job)
+		return waiters;
+	waiters.swap(flight->second.waiters);
+	m_cgiFlights.erase(flight);
+	return waiters;
+}
+
+/**
+ * job stops producing its key without an answer to share: its client left,
+ * or the answer turned out not cacheable. A waiting job just leaves its
+ * flight. The clients that waited on a leader ask again after this turn of
+ * the loop, where the first of them runs the script and the others wait on it.
+ */
+void Server::dropCgiFlight(CgiJob &job)
+{
+	if (job.waiting)
+	{
+		std::unordered_map<std::string, CgiFlight>::iterator flight = m_cgiFlights.find(job.cacheKey);
+		if (flight != m_cgiFlights.end())
+		{
+			std::vector<int> &waiters = flight->second.waiters;
+			waiters.erase(std::remove(waiters.begin(), waiters.end(), job.clientFd), waiters.end());
+		}
+		return;
+	}
+
+	std::vector<int> waiters = takeCgiWaiters(job);
+	for (size_t i = 0; i < waiters.size(); ++i)
+	{
+		Connection *conn = findConnection(waiters[i]);
+		if (conn && conn->cgi)
+			m_cgiRetries.push_back(std::make_pair(waiters[i], conn->cgi.get()));
+	}
+}
+
+void Server::answerCgiWaiters(const std::vector<int> &waiters, const CgiResult &cg)
+{
+	for (size_t i = 0; i < waiters.size(); ++i)
+	{
+		Connection *conn = findConnection(waiters[i]);
+		if (!conn || !conn->cgi || !conn->cgi->waiting)
+			continue;
+
+		Request request = conn->cgi->request;
+		releaseCgi(*conn);
+		queueCgiResponse(*conn, request, cg, "MISS");
+		resumeAfterCgi(*conn);
+	}
+}
+
+void Server::retryCgiWaiters()
+{
+	std::vector<std::pair<int, CgiJob *> > retries;
+	retries.swap(m_cgiRetries);
+
+	for (size_t i = 0; i < retries.size(); ++i)
+	{
+		Connection *conn = findConnection(retries[i].first);
+		if (!conn || conn->cgi.get() != retries[i].second)
+			continue;
+
+		CgiJob &job = *conn->cgi;
+		Request request = job.request;
+		std::string scriptPath = job.scriptPath;
+		const Location_struct &location = *job.location;
+		job.waiting = false;
+		job.cacheKey.clear();
+		releaseCgi(*conn);
+
+		handleCgiRequest(*conn, request, scriptPath, location);
+		if (!conn->cgi)
+			resumeAfterCgi(*conn);
+	}
+}
+
+/**
+ * What the script of a cacheable request answered: kept if its headers
+ * allow it, otherwise the entry goes, except when the script failed (5xx),
+ * which leaves a stale answer to be served until the end of its window.
+ */
+void Server::storeCgiResult(const std::string &key, const Location_struct &location, const CgiResult &cg)
+{
+	CgiCacheEntry entry;
+	if (cgiCacheFreshness(cg, location, ::time(NULL), entry))
+		m_cgiCache.store(key, entry);
+	else if (cg.status < 500)
+		m_cgiCache.erase(key);
+	else if (CgiCacheEntry *stale = m_cgiCache.find(key))
+		stale->refreshing = false;
+}
+
+// sends a request that holds a slot to its script, zygote or FastCGI application
+void Server::startCgiJob(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+	const Location_struct &location = *job.location;
+
+	job.started = true;
+
+	if (!location.fastcgi_pass.empty())
+	{
+		startFastCgiJob(conn, location);
+		return;
+	}
+
+	CgiZygote *zygote = location.cgi_zygote ? cgiZygote(location.cgi_path) : NULL;
+
+	// without a working zygote the script still runs, just from a fresh interpreter
+	if (zygote && sendCgiZygoteRequest(*zygote, job.params, job.scriptPath, job.proc))
+		zygote->pending.push_back(&job);
+	else if (!spawnCgi(job.params, job.scriptPath, location.cgi_path, job.proc))
+	{
+		perror("spawnCgi");
+		abortCgi(conn, 500, "<h1>500 Internal Server Error (CGI failed)</h1>");
+		return;
+	}
+	CgiParams().swap(job.params);
+
+	CgiProcess &proc = job.proc;
+	m_cgiFdOwner[proc.stdoutFd] = conn.fd;
+	m_loop->add(proc.stdoutFd, EventLoop::EV_READ);
+	if (job.input.empty() && !job.inputOpen)
+	{
+		::close(proc.stdinFd);
+		proc.stdinFd = -1;
+	}
+	else
+	{
+		// stdin is only watched while there is something to write
+		m_cgiFdOwner[proc.stdinFd] = conn.fd;
+		if (!job.input.empty())
+			m_loop->add(proc.stdinFd, EventLoop::EV_WRITE);
+	}
+	if (proc.pidFd >= 0)
+	{
+		m_cgiFdOwner[proc.pidFd] = conn.fd;
+		m_loop->add(proc.pidFd, EventLoop::EV_READ);
+	}
+}
+
+/**
+ * Gives back the slot (or queue place) of a job that is being released and
+ * starts the requests of this worker waiting for it; the other workers see
+ * the slot on their next admitQueuedCgi(). The job is off the connection
+ * by then.
+ */
+void Server::releaseCgiSlot(CgiJob &job)
+{
+	if (!job.location)
+		return;
+
+	const Location_struct &location = *job.location;
+	CgiLimit &limit = m_cgiLimits[&location];
+	if (!job.started)
+	{
+		std::deque<CgiJob *>::iterator it = std::find(limit.queue.begin(), limit.queue.end(), &job);
+		if (it != limit.queue.end())
+		{
+			limit.queue.erase(it);
+			limit.stats->queued--;
+			m_cgiQueued--;
+		}
+		return;
+	}
+
+	limit.stats->running--;
+	admitCgiQueue(location, limit);
+}
+
+// starts this worker's waiting requests of location, oldest first, while slots are free
+void Server::admitCgiQueue(const Location_struct &location, CgiLimit &limit)
+{
+	while (!limit.queue.empty() && takeCgiSlot(*limit.stats, location))
+	{
+		CgiJob *next = limit.queue.front();
+		limit.queue.pop_front();
+		limit.stats->queued--;
+		m_cgiQueued--;
+
+		Connection *conn = findConnection(next->clientFd);
+		if (conn && conn->cgi.get() == next)
+			startCgiJob(*conn);
+		else
+			limit.stats->running--;
+	}
+}
+
+/**
+ * Slots freed by another worker wake nothing here, so while requests wait
+ * the loop comes by every 10 ms and takes what is free.
+ */
+void Server::admitQueuedCgi()
+{
+	for (std::unordered_map<const Location_struct *, CgiLimit>::iterator it = m_cgiLimits.begin();
+		 it != m_cgiLimits.end() && m_cgiQueued; ++it)
+	{
+		if (!it->second.queue.empty())
+			admitCgiQueue(*it->first, it->second);
+	}
+}
+
+// plain text counters of every CGI location, summed over the workers
+void Server::queueCgiStats(Connection &conn, const Request &request)
+{
+	std::ostringstream out;
+	out << "worker_threads " << m_config->worker_threads << "\n";
+	for (size_t i = 0; i < m_config->servers.size(); ++i)
+	{
+		const Server_struct &server = m_config->servers[i];
+		for (size_t j = 0; j < server.locations.size(); ++j)
+		{
+			const Location_struct &location = server.locations[j];
+			if (location.cgi_extension.empty())
+				continue;
+			const CgiLocationStats &stats = cgiLocationStats(&location);
+			out << "location " << server.listen_port << location.path
+				<< " running " << stats.running
+				<< " queued " << stats.queued
+				<< " rejected " << stats.rejected
+				<< " timed_out " << stats.timedOut
+				<< " abandoned " << stats.abandoned
+				<< " cache_hits " << stats.cacheHits
+				<< " cache_stale " << stats.cacheStale
+				<< " cache_misses " << stats.cacheMisses
+				<< " cache_coalesced " << stats.cacheCoalesced
+				<< " max_concurrent " << location.cgi_max_concurrent
+				<< " queue_size " << location.cgi_queue_size
+				<< " timeout " << location.cgi_timeout << "\n";
+		}
+	}
+
+	Response res;
+	res.setStatus(200, reasonPhrase(200));
+	res.setHeader("Content-Type", "text/plain");
+	res.setHeader("Cache-Control", "no-store");
+	res.setBody(out.str());
+	queueResponse(conn, res, shouldKeepAlive(conn, request, 200));
+}
+
+// while the answer is produced the client's only deadline is the CGI one
+void Server::armCgiTimer(Connection &conn)
+{
+	conn.timerKind = TIMER_CGI;
+	m_timers.schedule(conn.fd, conn.cgi->deadlineMs);
+}
+
+bool Server::handleCgiEvent(int fd)
+{
+	std::unordered_map<int, int>::iterator owner = m_cgiFdOwner.find(fd);
+	if (owner == m_cgiFdOwner.end())
+		return false;
+
+	Connection *conn = findConnection(owner->second);
+	if (!conn || !conn->cgi)
+		return true;
+
+	CgiJob &job = *conn->cgi;
+	if (fd == job.proc.stdinFd)
+		writeCgiInput(*conn);
+	else if (fd == job.proc.stdoutFd)
+		readCgiOutput(*conn);
+	else if (fd == job.proc.pidFd)
+		reapCgi(*conn);
+
+	if (conn->cgi && conn->cgi->outputDone && conn->cgi->exited)
+		finishCgi(*conn);
+	else if (conn->cgi && conn->hasOutput())
+		handleClientWrite(*conn);
+	return true;
+}
+
+void Server::closeCgiFd(int &fd)
+{
+	if (fd < 0)
+		return;
+	m_loop->remove(fd);
+	m_cgiFdOwner.erase(fd);
+	::close(fd);
+	fd = -1;
+}
+
+void Server::writeCgiInput(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+
+	while (job.inputSent < job.input.size())
+	{
+		ssize_t n = ::write(job.proc.stdinFd, job.input.data() + job.inputSent, job.input.size() - job.inputSent);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			// EPIPE: the script stopped reading its input, it still gets to answer
+			closeCgiFd(job.proc.stdinFd);
+			break;
+		}
+		job.inputSent += n;
+	}
+
+	job.input.clear();
+	job.inputSent = 0;
+	job.inputBlocked = false;
+	if (!job.inputOpen)
+	{
+		closeCgiFd(job.proc.stdinFd);
+		return;
+	}
+	// the rest of the body is still with the client
+	if (job.proc.stdinFd >= 0)
+		m_loop->remove(job.proc.stdinFd);
+	updateCgiInterest(conn);
+}
+
+/**
+ * Moves the body bytes that reached inbuf to the script's input (dropping
+ * them once the script closed its stdin). When the body is complete the
+ * script gets EOF after the last of it, and requests pipelined behind it
+ * stay in inbuf until the answer is out.
+ */
+void Server::feedCgiBody(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+
+	m_uploadChunk.clear();
+	RequestFramer::Result framed = conn.framer.feed(conn.inbuf, &m_uploadChunk);
+	size_t scanned = conn.framer.scannedLength();
+	conn.inbuf.erase(0, scanned);
+	conn.framer.discard(scanned);
+
+	if (framed == RequestFramer::ERROR)
+	{
+		int status = conn.framer.errorStatus();
+		abortCgi(conn, status, "<h1>" + std::to_string(status) + " " + reasonPhrase(status) + "</h1>");
+		return;
+	}
+
+	if (!m_uploadChunk.empty() && (!job.started || job.proc.stdinFd >= 0))
+	{
+		if (job.input.empty() && job.proc.stdinFd >= 0 && !job.inputBlocked)
+			m_loop->add(job.proc.stdinFd, EventLoop::EV_WRITE);
+		job.input.append(m_uploadChunk);
+	}
+
+	if (framed == RequestFramer::COMPLETE)
+	{
+		job.inputOpen = false;
+		conn.framer.reset();
+		conn.bodyRouted = false;
+		if (job.input.empty() && !job.inputBlocked)
+			closeCgiFd(job.proc.stdinFd);
+	}
+}
+
+/**
+ * Client data while its body is streaming to a script. An identity body
+ * goes from the socket to stdin with splice() whenever nothing is buffered
+ * in between; a chunked one, or one for a script still waiting for its
+ * slot, passes through inbuf. The client is not read while stdin is full.
+ */
+void Server::readCgiBody(Connection &conn)
+{
+	char buffer[65536];
+
+	while (conn.cgi && conn.cgi->inputOpen && !conn.cgi->inputBlocked
+		   && conn.cgi->input.size() - conn.cgi->inputSent < CGI_INPUT_HIGH_WATER)
+	{
+		CgiJob &job = *conn.cgi;
+		bool splicing = job.proc.stdinFd >= 0 && job.input.empty() && conn.inbuf.empty() && conn.framer.bodyRemaining();
+
+		ssize_t n;
+		if (splicing)
+			n = ::splice(conn.fd, NULL, job.proc.stdinFd, NULL, std::min(conn.framer.bodyRemaining(), CGI_SPLICE_SIZE),
+						 SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		else
+			n = ::recv(conn.fd, buffer, sizeof(buffer), 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// splice() says EAGAIN for either side: if stdin is the full one, wait for it instead of the client
+			struct pollfd out = {job.proc.stdinFd, POLLOUT, 0};
+			if (splicing && ::poll(&out, 1, 0) == 0)
+			{
+				job.inputBlocked = true;
+				m_loop->add(job.proc.stdinFd, EventLoop::EV_WRITE);
+			}
+			break;
+		}
+		if (n < 0 && splicing && errno == EPIPE)
+		{
+			// the script stopped reading, the rest of the body is read and dropped
+			closeCgiFd(job.proc.stdinFd);
+			continue;
+		}
+		if (n <= 0)
+		{
+			// the client went away before its body was complete
+			cancelCgi(conn);
+			return;
+		}
+
+		// the script cannot answer before it has its input: body progress pushes the deadline back
+		if (job.location)
+		{
+			job.deadlineMs = TimerWheel::monotonicMs() + static_cast<uint64_t>(job.location->cgi_timeout) * 1000;
+			if (conn.timerKind == TIMER_CGI)
+				armCgiTimer(conn);
+		}
+
+		if (splicing)
+			conn.framer.skipBody(static_cast<size_t>(n));
+		else
+			conn.inbuf.append(buffer, n);
+		feedCgiBody(conn);
+
+		if (!m_loop->isEdgeTriggered())
+			break;
+	}
+
+	if (conn.isOpen() && conn.cgi)
+		updateCgiInterest(conn);
+}
+
+// a connection with a CGI in flight writes queued output and reads only a body its script still takes
+void Server::updateCgiInterest(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+	unsigned interest = conn.hasOutput() ? EventLoop::EV_WRITE : 0;
+
+	// a client that leaves cancels its script (cancelCgi()); while the body streams, reading it tells
+	if (!job.inputOpen)
+		interest |= EventLoop::EV_PEER_CLOSED;
+	else if (!job.inputBlocked && job.input.size() - job.inputSent < CGI_INPUT_HIGH_WATER)
+		interest |= EventLoop::EV_READ;
+	setInterest(conn, interest);
+}
+
+void Server::readCgiOutput(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+	char buffer[65536];
+
+	if (job.outputPaused)
+		return;
+	while (true)
+	{
+		ssize_t n = ::read(job.proc.stdoutFd, buffer, sizeof(buffer));
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR)
+				continue;
+			perror("read(cgi)");
+			break;
+		}
+		if (n == 0)
+			break;
+
+		job.output.append(buffer, n);
+		relayCgiOutput(conn);
+		if (job.streaming && conn.pendingOutput() >= CGI_STREAM_HIGH_WATER)
+		{
+			// the client is slower than the script: leave the rest in the pipe
+			m_loop->remove(job.proc.stdoutFd);
+			job.outputPaused = true;
+			return;
+		}
+		if (!m_loop->isEdgeTriggered())
+			return;
+	}
+
+	closeCgiFd(job.proc.stdoutFd);
+	job.outputDone = true;
+	// without a pidfd nothing wakes the loop at the exit: poll for it rather than block in waitpid();
+	// a child orphaned by its zygote already counts as exited and has no pid left to wait for
+	if (job.proc.pidFd < 0 && !job.proc.zygote && !job.exited)
+	{
+		reapCgi(conn);
+		if (!job.exited)
+			m_cgiExitPolls.push_back(conn.fd);
+	}
+}
+
+/**
+ * Moves what the script wrote so far to the client: nothing until the
+ * header block is complete, then the head once and the body as it comes.
+ * FastCGI output takes the same way.
+ */
+void Server::relayCgiOutput(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+
+	if (job.buffered && !job.cacheKey.empty() && job.output.size() > CGI_CACHE_MAX_ENTRY)
+	{
+		// too big to cache: a client gets it streamed after all, a refresh gives up the entry
+		if (job.refresh)
+			m_cgiCache.erase(job.cacheKey);
+		dropCgiFlight(job);
+		job.cacheKey.clear();
+		job.buffered = false;
+	}
+	if (job.refresh)
+	{
+		// nobody to stream to, and nothing to keep once the entry is gone
+		if (job.cacheKey.empty())
+			job.output.clear();
+		return;
+	}
+
+	if (!job.streaming)
+	{
+		size_t bodyStart = 0;
+		size_t headEnd = job.buffered ? std::string::npos : findCgiHeaderEnd(job.output, bodyStart);
+		if (headEnd == std::string::npos)
+			return;
+		queueCgiStreamHead(conn, job.output.substr(0, headEnd));
+		if (!job.streaming)
+			return;
+		job.output.erase(0, bodyStart);
+	}
+
+	if (job.output.empty())
+		return;
+
+	// a streamed answer only times out when the script stays silent for cgi_timeout
+	if (job.location)
+		job.deadlineMs = TimerWheel::monotonicMs() + static_cast<uint64_t>(job.location->cgi_timeout) * 1000;
+	if (!job.chunked)
+	{
+		// whatever goes beyond the announced Content-Length is dropped
+		if (job.output.size() > job.bodyLeft)
+			job.output.resize(job.bodyLeft);
+		job.bodyLeft -= job.output.size();
+		if (job.output.empty())
+			return;
+	}
+
+	if (job.chunked)
+	{
+		char size[32];
+		std::snprintf(size, sizeof(size), "%zx\r\n", job.output.size());
+		conn.output.emplace_back();
+		conn.output.back().bytes = size;
+	}
+	conn.output.emplace_back();
+	conn.output.back().bytes.swap(job.output);
+	if (job.chunked)
+	{
+		conn.output.emplace_back();
+		conn.output.back().bytes = "\r\n";
+	}
+}
+
+void Server::queueCgiStreamHead(Connection &conn, const std::string &head)
+{
+	CgiJob &job = *conn.cgi;
+	CgiResult cg;
+	parseCgiHeaders(head, cg);
+
+	std::map<std::string, std::string>::const_iterator length = cg.headers.find("content-length");
+	char *end = NULL;
+	bool hasLength = length != cg.headers.end() && !length->second.empty();
+	unsigned long long bodyLength = hasLength ? std::strtoull(length->second.c_str(), &end, 10) : 0;
+	hasLength = hasLength && *end == '\0';
+
+	// a cacheable answer is collected whole and stored before it goes out
+	if (!job.cacheKey.empty())
+	{
+		CgiCacheEntry probe;
+		if (job.refresh || cgiCacheFreshness(cg, *job.location, ::time(NULL), probe))
+		{
+			job.buffered = true;
+			return;
+		}
+		dropCgiFlight(job);
+		job.cacheKey.clear();
+	}
+
+	// an HTTP/1.0 client cannot take chunks: without a length it gets the whole answer at the end
+	if (!hasLength && job.request.getVersion() == "HTTP/1.0")
+	{
+		job.buffered = true;
+		return;
+	}
+
+	Response res;
+	int status = cg.status ? cg.status : 200;
+	res.setStatus(status, reasonPhrase(status));
+	setCgiHeaders(res, cg.headers);
+	if (hasLength)
+	{
+		res.setHeader("Content-Length", std::to_string(bodyLength));
+		job.bodyLeft = static_cast<size_t>(bodyLength);
+	}
+	else
+	{
+		res.setHeader("Transfer-Encoding", "chunked");
+		job.chunked = true;
+	}
+
+	queueResponse(conn, res, shouldKeepAlive(conn, job.request, status));
+	job.streaming = true;
+}
+
+// called as the client drains a streamed body: read the script again once most of it is out
+void Server::resumeCgiOutput(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+
+	if (conn.pendingOutput() >= CGI_STREAM_LOW_WATER)
+		return;
+	job.outputPaused = false;
+	if (job.location)
+		job.deadlineMs = TimerWheel::monotonicMs() + static_cast<uint64_t>(job.location->cgi_timeout) * 1000;
+	if (job.proc.stdoutFd >= 0 && !m_loop->add(job.proc.stdoutFd, EventLoop::EV_READ))
+		abortCgi(conn, 502, "<h1>502 Bad Gateway (CGI output lost)</h1>");
+}
+
+void Server::reapCgi(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+
+	if (::waitpid(job.proc.pid, &job.waitStatus, WNOHANG) == 0)
+		return;
+	job.exited = true;
+	closeCgiFd(job.proc.pidFd);
+}
+
+/**
+ * Drops the job of a connection. A child that is still running is killed
+ * with its process group; if it is not gone yet it is reaped later by
+ * reapCgiZombies(). A FastCGI
+ * request is taken off its upstream instead, and a zygote child is left
+ * for the zygote to reap.
+ */
+void Server::releaseCgi(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+
+	if (!job.cacheKey.empty())
+		dropCgiFlight(job);
+	if (job.fastCgiPool)
+		detachFastCgiJob(job);
+	if (job.proc.zygote)
+		detachZygoteChild(job);
+	else if (job.proc.pid > 0 && !job.exited)
+	{
+		// the child leads its own process group (POSIX_SPAWN_SETPGROUP): whatever it started goes too
+		if (::kill(-job.proc.pid, SIGKILL) < 0)
+			::kill(job.proc.pid, SIGKILL);
+		if (::waitpid(job.proc.pid, NULL, WNOHANG) == 0)
+			m_cgiZombies.push_back(job.proc.pid);
+	}
+	closeCgiFd(job.proc.stdinFd);
+	closeCgiFd(job.proc.stdoutFd);
+	closeCgiFd(job.proc.pidFd);
+
+	std::unique_ptr<CgiJob> released = std::move(conn.cgi);
+	releaseCgiSlot(*released);
+}
+
+void Server::reapCgiZombies()
+{
+	for (size_t i = 0; i < m_cgiZombies.size();)
+	{
+		if (::waitpid(m_cgiZombies[i], NULL, WNOHANG) == 0)
+		{
+			++i;
+			continue;
+		}
+		m_cgiZombies[i] = m_cgiZombies.back();
+		m_cgiZombies.pop_back();
+	}
+}
+
+// jobs whose output ended before their script exited, and that have no pidfd to say when it does
+void Server::pollCgiExits()
+{
+	std::vector<int> polled;
+	polled.swap(m_cgiExitPolls);
+	for (size_t i = 0; i < polled.size(); ++i)
+	{
+		Connection *conn = findConnection(polled[i]);
+		if (!conn || !conn->cgi || conn->cgi->exited || conn->cgi->proc.pidFd >= 0 || conn->cgi->proc.zygote
+			|| !conn->cgi->outputDone)
+			continue;
+		reapCgi(*conn);
+		if (conn->cgi->exited)
+			finishCgi(*conn);
+		else
+			m_cgiExitPolls.push_back(polled[i]);
+	}
+}
+
+void Server::queueCgiResponse(Connection &conn, const Request &request, const CgiResult &cg, const char *cacheState)
+{
+	Response res;
+	int status = cg.status ? cg.status : 200;
+	res.setStatus(status, reasonPhrase(status));
+
+	setCgiHeaders(res, cg.headers);
+	if (cacheState)
+		res.setHeader("X-Cache", cacheState);
+
+	res.setBody(cg.body);
+	queueResponse(conn, res, shouldKeepAlive(conn, request, status));
+}
+
+// the answer is queued: send it and carry on with whatever was pipelined behind it
+void Server::resumeAfterCgi(Connection &conn)
+{
+	processBufferedRequests(conn);
+	if (conn.isOpen() && conn.hasOutput())
+		handleClientWrite(conn);
+}
+
+void Server::finishCgi(Connection &conn)
+{
+	if (conn.cgi->streaming)
+	{
+		finishCgiStream(conn);
+		return;
+	}
+
+	CgiResult cg = parseCgiOutput(conn.cgi->output, conn.cgi->waitStatus);
+	Request request = conn.cgi->request;
+	std::string cacheKey = conn.cgi->cacheKey;
+	const Location_struct *location = conn.cgi->location;
+	bool refresh = conn.cgi->refresh;
+	std::vector<int> waiters = takeCgiWaiters(*conn.cgi);
+
+	releaseCgi(conn);
+	if (!cacheKey.empty())
+		storeCgiResult(cacheKey, *location, cg);
+	if (refresh)
+		closeClientConnection(conn);
+	else
+	{
+		queueCgiResponse(conn, request, cg, cacheKey.empty() ? NULL : "MISS");
+		resumeAfterCgi(conn);
+	}
+	answerCgiWaiters(waiters, cg);
+}
+
+/**
+ * The status line of a streamed answer is already out, so a script that
+ * failed or wrote less than its Content-Length can only be reported by
+ * ending the connection without the last chunk.
+ */
+void Server::finishCgiStream(Connection &conn)
+{
+	CgiJob &job = *conn.cgi;
+	bool failed = !WIFEXITED(job.waitStatus) || WEXITSTATUS(job.waitStatus) != 0 || (!job.chunked && job.bodyLeft);
+	bool chunked = job.chunked;
+
+	releaseCgi(conn);
+	if (failed)
+		conn.closeAfterWrite = true;
+	else if (chunked)
+	{
+		conn.output.emplace_back();
+		conn.output.back().bytes = "0\r\n\r\n";
+	}
+	resumeAfterCgi(conn);
+}
+
+// answers a CGI request that will not complete normally (timeout, upstream failure)
+void Server::abortCgi(Connection &conn, int status, const std::string &body)
+{
+	// too late for an error page once a streamed answer has started
+	if (conn.cgi->streaming)
+	{
+		closeClientConnection(conn);
+		return;
+	}
+
+	Request request = conn.cgi->request;
+	std::string cacheKey = conn.cgi->waiting ? std::string() : conn.cgi->cacheKey;
+	const Location_struct *location = conn.cgi->location;
+	bool refresh = conn.cgi->refresh;
+	std::vector<int> waiters = takeCgiWaiters(*conn.cgi);
+
+	releaseCgi(conn);
+	CgiResult cg;
+	cg.status = status;
+	cg.body = body;
+	if (!cacheKey.empty())
+		storeCgiResult(cacheKey, *location, cg);
+	if (refresh)
+		closeClientConnection(conn);
+	else
+	{
+		queueCgiResponse(conn, request, cg);
+		resumeAfterCgi(conn);
+	}
+	// they asked for the same thing at the same time, they get the same failure
+	answerCgiWaiters(waiters, cg);
+}
+
+/**
+ * The client hung up (HUP, or RDHUP while nobody reads from it) before its
+ * answer was out: the script, its process group and every buffer of the
+ * connection go right away instead of at the end of the script or its
+ * timeout. A client still sending its body is only given up on once that
+ * body turns out to be incomplete.
+ */
+void Server::cancelCgi(Connection &conn)
+{
+	if (conn.cgi->location)
+		m_cgiLimits[conn.cgi->location].stats->abandoned++;
+	closeClientConnection(conn);
+}
+
+void Server::handleCgiTimeout(Connection &conn)
+{
+	if (conn.cgi->location)
+		m_cgiLimits[conn.cgi->location].stats->timedOut++;
+	abortCgi(conn, 504, "<h1>504 Gateway Timeout (CGI read timeout)</h1>");
+}
+
+// the zygote of an interpreter, started on first use
+CgiZygote *Server::cgiZygote(const std::string &interpreter)
+{
+	std::map<std::string, std::unique_ptr<CgiZygote> >::iterator it = m_cgiZygotes.find(interpreter);
+	if (it != m_cgiZygotes.end())
+		return it->second.get();
+
+	std::unique_ptr<CgiZygote> zygote(new CgiZygote());
+	if (!startCgiZygote(interpreter, *zygote))
+	{
+		perror(("cgi zygote " + interpreter).c_str());
+		return NULL;
+	}
+	if (!m_loop->add(zygote->fd, EventLoop::EV_READ))
+	{
+		::close(zygote->fd);
+		::kill(zygote->pid, SIGKILL);
+		m_cgiZombies.push_back(zygote->pid);
+		return NULL;
+	}
+	m_cgiZygoteFds[zygote->fd] = zygote.get();
+	return (m_cgiZygotes[interpreter] = std::move(zygote)).get();
+}
+
+void Server::detachZygoteChild(CgiJob &job)
+{
+	CgiZygote &zygote = *job.proc.zygote;
+
+	if (job.proc.pid < 0)
+		std::replace(zygote.pending.begin(), zygote.pending.end(), &job, static_cast<CgiJob *>(NULL));
+	else if (!job.exited)
+	{
+		zygote.running.erase(job.proc.pid);
+		signalZygoteChild(job.proc.pid, job.proc.pidFd, SIGKILL);
+		// the child made itself a process group leader, anything it started is in there
+		::kill(-job.proc.pid, SIGKILL);
+	}
+	job.proc.zygote = NULL;
+}
+
+// not our child, so no waitpid(); a pidfd cannot hit a recycled pid
+void Server::signalZygoteChild(pid_t pid, int pidFd, int sig)
+{
+	if (pidFd >= 0 && ::syscall(SYS_pidfd_send_signal, pidFd, sig, NULL, 0) == 0)
+		return;
+	::kill(pid, sig);
+}
+
+bool Server::handleCgiZygoteEvent(int fd)
+{
+	std::unordered_map<int, CgiZygote *>::iterator it = m_cgiZygoteFds.find(fd);
+	if (it == m_cgiZygoteFds.end())
+		return false;
+
+	CgiZygote &zygote = *it->second;
+	while (true)
+	{
+		char buffer[64];
+		char control[CMSG_SPACE(sizeof(int))];
+		int pidFd = -1;
+
+		struct iovec iov;
+		iov.iov_base = buffer;
+		iov.iov_len = sizeof(buffer) - 1;
+
+		struct msghdr hdr;
+		std::memset(&hdr, 0, sizeof(hdr));
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+
+		ssize_t n = ::recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			closeCgiZygote(zygote);
+			break;
+		}
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			std::memcpy(&pidFd, CMSG_DATA(cmsg), sizeof(int));
+		buffer[n] = '\0';
+		handleCgiZygoteMessage(zygote, buffer, pidFd);
+	}
+	return true;
+}
+
+void Server::handleCgiZygoteMessage(CgiZygote &zygote, const char *msg, int pidFd)
+{
+	char *end = NULL;
+	pid_t pid = static_cast<pid_t>(std::strtol(msg + 1, &end, 10));
+
+	if (msg[0] == 'P' && !zygote.pending.empty())
+	{
+		CgiJob *job = zygote.pending.front();
+		zygote.pending.pop_front();
+		if (!job)
+		{
+			// the client went away before the child existed
+			if (pid > 0)
+				signalZygoteChild(pid, pidFd, SIGKILL);
+			if (pidFd >= 0)
+				::close(pidFd);
+			return;
+		}
+		if (pid <= 0)
+		{
+			job->proc.zygote = NULL;
+			abortCgi(*findConnection(job->clientFd), 500, "<h1>500 Internal Server Error (CGI failed)</h1>");
+			return;
+		}
+		job->proc.pid = pid;
+		job->proc.pidFd = pidFd;
+		zygote.running[pid] = job;
+		return;
+	}
+
+	if (pidFd >= 0)
+		::close(pidFd);
+	if (msg[0] != 'X')
+		return;
+
+	std::unordered_map<pid_t, CgiJob *>::iterator it = zygote.running.find(pid);
+	if (it == zygote.running.end())
+		return;
+	CgiJob *job = it->second;
+	zygote.running.erase(it);
+	job->waitStatus = static_cast<int>(std::strtol(end, NULL, 10));
+	job->exited = true;
+
+	Connection *conn = findConnection(job->clientFd);
+	if (conn && conn->cgi.get() == job && job->outputDone)
+		finishCgi(*conn);
+}
+
+/**
+ * The zygote is gone: requests it had not forked yet fail with 502,
+ * children it already started are orphaned and count as exited (status 0)
+ * once their output ends. The next request starts a new zygote.
+ */
+void Server::closeCgiZygote(CgiZygote &zygote)
+{
+	std::unique_ptr<CgiZygote> owned = std::move(m_cgiZygotes[zygote.interpreter]);
+	m_cgiZygotes.erase(zygote.interpreter);
+	m_cgiZygoteFds.erase(zygote.fd);
+	m_loop->remove(zygote.fd);
+	::close(zygote.fd);
+	if (::waitpid(zygote.pid, NULL, WNOHANG) == 0)
+	{
+		::kill(zygote.pid, SIGKILL);
+		m_cgiZombies.push_back(zygote.pid);
+	}
+
+	std::vector<int> finished;
+	std::vector<int> failed;
+	for (std::unordered_map<pid_t, CgiJob *>::iterator it = zygote.running.begin(); it != zygote.running.end(); ++it)
+	{
+		CgiJob *job = it->second;
+		job->proc.zygote = NULL;
+		job->proc.pid = -1;
+		job->exited = true;
+		if (job->outputDone)
+			finished.push_back(job->clientFd);
+	}
+	for (size_t i = 0; i < zygote.pending.size(); ++i)
+	{
+		if (zygote.pending[i])
+		{
+			zygote.pending[i]->proc.zygote = NULL;
+			failed.push_back(zygote.pending[i]->clientFd);
+		}
+	}
+
+	// answering a client may start its next request, so the lists are walked by fd
+	for (size_t i = 0; i < finished.size(); ++i)
+	{
+		Connection *conn = findConnection(finished[i]);
+		if (conn && conn->cgi && conn->cgi->exited && conn->cgi->outputDone)
+			finishCgi(*conn);
+	}
+	for (size_t i = 0; i < failed.size(); ++i)
+	{
+		Connection *conn = findConnection(failed[i]);
+		if (conn && conn->cgi && !conn->cgi->proc.zygote && conn->cgi->proc.pid < 0)
+			abortCgi(*conn, 502, "<h1>502 Bad Gateway (CGI zygote exited)</h1>");
+	}
+}
@@ -0,0 +1,353 @@
+#include "headers.hpp"
+
+// pooled connections per fastcgi_pass address and worker
+static const size_t FASTCGI_MAX_CONNS = 8;
+
+/**
+ * FastCGI requests reuse the CGI job of the connection (same pause, same
+ * deadline, same response path) but instead of a process they get a
+ * request id on a pooled socket to the application. Jobs wait in the
+ * upstream's queue while every connection is at capacity.
+ */
+void Server::startFastCgiJob(Connection &conn, const Location_struct &location)
+{
+	std::unique_ptr<FastCgiUpstream> &pool = m_fastCgiUpstreams[location.fastcgi_pass];
+	if (!pool)
+	{
+		pool.reset(new FastCgiUpstream());
+		pool->address = location.fastcgi_pass;
+		pool->addr = location.fastcgi_addr;
+		pool->addrLength = location.fastcgi_addrlen;
+	}
+
+	conn.cgi->fastCgiPool = pool.get();
+	pool->waiting.push_back(conn.cgi.get());
+	dispatchFastCgi(*pool);
+}
+
+FastCgiConnection *Server::openFastCgiConnection(FastCgiUpstream &pool)
+{
+	int fd = fastCgiConnect(pool.addr, pool.addrLength);
+	if (fd < 0)
+	{
+		perror(("fastcgi connect " + pool.address).c_str());
+		return NULL;
+	}
+	if (!m_loop->add(fd, EventLoop::EV_READ | EventLoop::EV_WRITE))
+	{
+		::close(fd);
+		return NULL;
+	}
+
+	std::unique_ptr<FastCgiConnection> fc(new FastCgiConnection());
+	fc->fd = fd;
+	fc->pool = &pool;
+	fastCgiEncodeGetValues(fc->outbuf);
+
+	FastCgiConnection *raw = fc.get();
+	pool.conns.push_back(std::move(fc));
+	m_fastCgiFds[fd] = raw;
+	return raw;
+}
+
+// hands queued jobs to connections with room, opening new ones up to FASTCGI_MAX_CONNS
+void Server::dispatchFastCgi(FastCgiUpstream &pool)
+{
+	while (!pool.waiting.empty())
+	{
+		FastCgiConnection *target = NULL;
+		for (size_t i = 0; i < pool.conns.size() && !target; ++i)
+		{
+			if (pool.conns[i]->requests.size() < pool.conns[i]->capacity)
+				target = pool.conns[i].get();
+		}
+		if (!target && pool.conns.size() < FASTCGI_MAX_CONNS)
+		{
+			target = openFastCgiConnection(pool);
+			if (!target)
+			{
+				CgiJob *job = pool.waiting.front();
+				pool.waiting.pop_front();
+				failFastCgiJob(job, 502);
+				continue;
+			}
+		}
+		if (!target)
+			return;
+
+		uint16_t id = target->allocateId();
+		if (!id)
+			return;
+
+		CgiJob *job = pool.waiting.front();
+		pool.waiting.pop_front();
+
+		fastCgiEncodeRequest(target->outbuf, id, job->params, job->input);
+		CgiParams().swap(job->params);
+		std::string().swap(job->input);
+
+		job->fastCgiConn = target;
+		job->fastCgiId = id;
+		target->requests[id] = job;
+		if (target->connected)
+			m_loop->modify(target->fd, EventLoop::EV_READ | EventLoop::EV_WRITE);
+	}
+}
+
+// the client of a job is answered with an error, the job itself is gone afterwards
+void Server::failFastCgiJob(CgiJob *job, int status)
+{
+	Connection *conn = findConnection(job->clientFd);
+	if (!conn || conn->cgi.get() != job)
+		return;
+
+	job->fastCgiConn = NULL;
+	job->fastCgiPool = NULL;
+	if (status == 503)
+		abortCgi(*conn, 503, "<h1>503 Service Unavailable (FastCGI application overloaded)</h1>");
+	else
+		abortCgi(*conn, 502, "<h1>502 Bad Gateway (FastCGI application unavailable)</h1>");
+}
+
+/**
+ * Called by releaseCgi(): a queued job leaves the queue, an active one is
+ * aborted on the wire and its id stays reserved until END_REQUEST. An
+ * application that ignores the abort would hold that slot for good, so
+ * after cgi_timeout the whole connection is dropped and the pool opens a
+ * fresh one.
+ */
+void Server::detachFastCgiJob(CgiJob &job)
+{
+	if (job.fastCgiConn)
+	{
+		FastCgiConnection &fc = *job.fastCgiConn;
+		fc.requests[job.fastCgiId] = NULL;
+		fc.aborted[job.fastCgiId] = TimerWheel::monotonicMs() + static_cast<uint64_t>(job.location->cgi_timeout) * 1000;
+		armFastCgiAbortTimer(fc);
+		fastCgiAppendRecord(fc.outbuf, FCGI_ABORT_REQUEST, job.fastCgiId, "", 0);
+		if (fc.connected)
+			m_loop->modify(fc.fd, EventLoop::EV_READ | EventLoop::EV_WRITE);
+	}
+	else if (job.fastCgiPool)
+	{
+		std::deque<CgiJob *> &waiting = job.fastCgiPool->waiting;
+		std::deque<CgiJob *>::iterator it = std::find(waiting.begin(), waiting.end(), &job);
+		if (it != waiting.end())
+			waiting.erase(it);
+	}
+	job.fastCgiConn = NULL;
+	job.fastCgiPool = NULL;
+}
+
+// the connection's timer runs to its earliest unanswered abort
+void Server::armFastCgiAbortTimer(FastCgiConnection &fc)
+{
+	if (fc.aborted.empty())
+	{
+		m_timers.cancel(fc.fd);
+		return;
+	}
+	uint64_t deadline = fc.aborted.begin()->second;
+	for (std::map<uint16_t, uint64_t>::iterator it = fc.aborted.begin(); it != fc.aborted.end(); ++it)
+		deadline = std::min(deadline, it->second);
+	m_timers.schedule(fc.fd, deadline);
+}
+
+bool Server::handleFastCgiEvent(int fd, unsigned events)
+{
+	std::unordered_map<int, FastCgiConnection *>::iterator it = m_fastCgiFds.find(fd);
+	if (it == m_fastCgiFds.end())
+		return false;
+
+	FastCgiConnection &fc = *it->second;
+	bool ok = true;
+
+	if (events & EventLoop::EV_ERROR)
+		ok = false;
+	if (ok && !fc.connected && (events & (EventLoop::EV_WRITE | EventLoop::EV_HANGUP)))
+	{
+		int err = 0;
+		socklen_t len = sizeof(err);
+		ok = ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+		fc.connected = ok;
+	}
+	if (ok && fc.connected && (events & EventLoop::EV_WRITE))
+		ok = flushFastCgi(fc);
+	if (ok && fc.connected && (events & (EventLoop::EV_READ | EventLoop::EV_HANGUP)))
+		ok = readFastCgi(fc);
+
+	if (!ok)
+		closeFastCgiConnection(fc);
+	return true;
+}
+
+bool Server::flushFastCgi(FastCgiConnection &fc)
+{
+	while (fc.outSent < fc.outbuf.size())
+	{
+		ssize_t n = ::send(fc.fd, fc.outbuf.data() + fc.outSent, fc.outbuf.size() - fc.outSent, MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			if (errno == EINTR)
+				continue;
+			perror("send(fastcgi)");
+			return false;
+		}
+		fc.outSent += n;
+	}
+	fc.outbuf.clear();
+	fc.outSent = 0;
+	m_loop->modify(fc.fd, EventLoop::EV_READ);
+	return true;
+}
+
+bool Server::readFastCgi(FastCgiConnection &fc)
+{
+	char buffer[65536];
+	bool open = true;
+
+	while (true)
+	{
+		ssize_t n = ::recv(fc.fd, buffer, sizeof(buffer), 0);
+		if (n < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			perror("recv(fastcgi)");
+			open = false;
+			break;
+		}
+		if (n == 0)
+		{
+			open = false;
+			break;
+		}
+		fc.inbuf.append(buffer, n);
+		if (!m_loop->isEdgeTriggered())
+			break;
+	}
+
+	// complete records are handled in order, a partial one stays in inbuf
+	size_t pos = 0;
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(fc.inbuf.data());
+	while (fc.inbuf.size() - pos >= FCGI_HEADER_LEN)
+	{
+		size_t contentLength = (static_cast<size_t>(p[pos + 4]) << 8) | p[pos + 5];
+		size_t recordLength = FCGI_HEADER_LEN + contentLength + p[pos + 6];
+		if (fc.inbuf.size() - pos < recordLength)
+			break;
+
+		unsigned char type = p[pos + 1];
+		uint16_t id = static_cast<uint16_t>((p[pos + 2] << 8) | p[pos + 3]);
+		handleFastCgiRecord(fc, type, id, fc.inbuf.data() + pos + FCGI_HEADER_LEN, contentLength);
+		pos += recordLength;
+		p = reinterpret_cast<const unsigned char *>(fc.inbuf.data());
+	}
+	fc.inbuf.erase(0, pos);
+	return open;
+}
+
+void Server::handleFastCgiRecord(FastCgiConnection &fc, unsigned char type, uint16_t id, const char *data, size_t len)
+{
+	if (type == FCGI_GET_VALUES_RESULT)
+	{
+		std::map<std::string, std::string> values = fastCgiDecodeParams(data, len);
+		if (values["FCGI_MPXS_CONNS"] == "1")
+		{
+			long maxReqs = std::strtol(values["FCGI_MAX_REQS"].c_str(), NULL, 10);
+			fc.capacity = (maxReqs > 0) ? std::min<size_t>(static_cast<size_t>(maxReqs), 64) : 64;
+			dispatchFastCgi(*fc.pool);
+		}
+		return;
+	}
+
+	std::map<uint16_t, CgiJob *>::iterator it = fc.requests.find(id);
+	if (it == fc.requests.end())
+		return;
+	CgiJob *job = it->second;
+
+	if (type == FCGI_STDOUT && job)
+	{
+		job->output.append(data, len);
+		Connection *conn = findConnection(job->clientFd);
+		if (conn && conn->cgi.get() == job)
+		{
+			relayCgiOutput(*conn);
+			if (conn->hasOutput())
+				handleClientWrite(*conn);
+		}
+	}
+	else if (type == FCGI_STDERR && len)
+		std::cerr.write(data, len);
+	else if (type == FCGI_END_REQUEST)
+	{
+		fc.requests.erase(it);
+		if (fc.aborted.erase(id))
+			armFastCgiAbortTimer(fc);
+		if (job)
+			completeFastCgiJob(*job, data, len);
+		dispatchFastCgi(*fc.pool);
+	}
+}
+
+void Server::completeFastCgiJob(CgiJob &job, const char *data, size_t len)
+{
+	job.fastCgiConn = NULL;
+	job.fastCgiPool = NULL;
+
+	Connection *conn = findConnection(job.clientFd);
+	if (!conn || conn->cgi.get() != &job)
+		return;
+
+	// appStatus (4 bytes) then protocolStatus: 0 complete, 1 cannot multiplex, 2 overloaded, 3 unknown role
+	const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+	unsigned char protocolStatus = (len >= 5) ? p[4] : 0;
+	if (protocolStatus == 2)
+	{
+		abortCgi(*conn, 503, "<h1>503 Service Unavailable (FastCGI application overloaded)</h1>");
+		return;
+	}
+	if (protocolStatus != 0)
+	{
+		abortCgi(*conn, 502, "<h1>502 Bad Gateway (FastCGI request rejected)</h1>");
+		return;
+	}
+
+	int appStatus = (len >= 4) ? static_cast<int>(p[3]) : 0;
+	job.waitStatus = W_EXITCODE(appStatus, 0);
+	job.outputDone = true;
+	job.exited = true;
+	finishCgi(*conn);
+}
+
+// the socket is dropped from the pool first, so failing its jobs cannot hand them back to it
+void Server::closeFastCgiConnection(FastCgiConnection &fc)
+{
+	FastCgiUpstream &pool = *fc.pool;
+	std::unique_ptr<FastCgiConnection> owned;
+	for (size_t i = 0; i < pool.conns.size(); ++i)
+	{
+		if (pool.conns[i].get() == &fc)
+		{
+			owned = std::move(pool.conns[i]);
+			pool.conns.erase(pool.conns.begin() + i);
+			break;
+		}
+	}
+
+	m_timers.cancel(fc.fd);
+	m_loop->remove(fc.fd);
+	m_fastCgiFds.erase(fc.fd);
+	::close(fc.fd);
+
+	for (std::map<uint16_t, CgiJob *>::iterator it = fc.requests.begin(); it != fc.requests.end(); ++it)
+	{
+		if (it->second)
+			failFastCgiJob(it->second, 502);
+	}
+	dispatchFastCgi(pool);
+}
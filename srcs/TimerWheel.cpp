@@ -0,0 +1,174 @@
+#include "headers.hpp"
+
+TimerWheel::TimerWheel(unsigned tickMs) : m_tickMs(tickMs ? tickMs : 1), m_now(0), m_count(0)
+{
+	for (int l = 0; l < LEVELS; ++l)
+		for (int s = 0; s < SLOTS; ++s)
+			m_heads[l][s] = -1;
+	m_now = monotonicMs() / m_tickMs;
+}
+
+uint64_t TimerWheel::monotonicMs()
+{
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void TimerWheel::link(int id)
+{
+	Node &node = m_nodes[id];
+	uint64_t expires = node.expires;
+	uint64_t delta = expires - m_now;
+
+	// the last level keeps anything further out and re-sorts it on cascade
+	if (delta >= (1ULL << (SLOT_BITS * LEVELS)))
+		expires = m_now + (1ULL << (SLOT_BITS * LEVELS)) - 1;
+
+	int level = 0;
+	while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+		++level;
+
+	node.level = level;
+	node.slot = static_cast<int>((expires >> (SLOT_BITS * level)) & SLOT_MASK);
+	node.prev = -1;
+	node.next = m_heads[level][node.slot];
+	if (node.next != -1)
+		m_nodes[node.next].prev = id;
+	m_heads[level][node.slot] = id;
+	node.active = true;
+}
+
+void TimerWheel::unlink(int id)
+{
+	Node &node = m_nodes[id];
+
+	if (node.prev != -1)
+		m_nodes[node.prev].next = node.next;
+	else
+		m_heads[node.level][node.slot] = node.next;
+	if (node.next != -1)
+		m_nodes[node.next].prev = node.prev;
+	node.prev = -1;
+	node.next = -1;
+	node.active = false;
+}
+
+void TimerWheel::schedule(int id, uint64_t deadlineMs)
+{
+	if (id < 0)
+		return;
+	if (static_cast<size_t>(id) >= m_nodes.size())
+		m_nodes.resize(id + 1, Node{0, -1, -1, 0, 0, false});
+
+	if (m_nodes[id].active)
+		unlink(id);
+	else
+		++m_count;
+
+	uint64_t expires = (deadlineMs + m_tickMs - 1) / m_tickMs;
+	if (expires <= m_now)
+		expires = m_now + 1;
+	m_nodes[id].expires = expires;
+	link(id);
+}
+
+void TimerWheel::cancel(int id)
+{
+	if (!isScheduled(id))
+		return;
+	unlink(id);
+	--m_count;
+}
+
+bool TimerWheel::isScheduled(int id) const
+{
+	return id >= 0 && static_cast<size_t>(id) < m_nodes.size() && m_nodes[id].active;
+}
+
+size_t TimerWheel::size() const
+{
+	return m_count;
+}
+
+void TimerWheel::cascade(int level, int slot)
+{
+	int id = m_heads[level][slot];
+	m_heads[level][slot] = -1;
+
+	while (id != -1)
+	{
+		int next = m_nodes[id].next;
+		m_nodes[id].active = false;
+		link(id);
+		id = next;
+	}
+}
+
+void TimerWheel::advance(uint64_t nowMs, std::vector<int> &expired)
+{
+	uint64_t target = nowMs / m_tickMs;
+
+	// nothing pending: jump instead of walking every empty tick
+	if (m_count == 0)
+	{
+		if (target > m_now)
+			m_now = target;
+		return;
+	}
+
+	while (m_now < target && m_count > 0)
+	{
+		++m_now;
+
+		uint64_t index = m_now;
+		for (int level = 1; level < LEVELS && (index & SLOT_MASK) == 0; ++level)
+		{
+			index >>= SLOT_BITS;
+			cascade(level, static_cast<int>(index & SLOT_MASK));
+		}
+
+		int slot = static_cast<int>(m_now & SLOT_MASK);
+		int id = m_heads[0][slot];
+		m_heads[0][slot] = -1;
+		while (id != -1)
+		{
+			int next = m_nodes[id].next;
+			m_nodes[id].active = false;
+			if (m_nodes[id].expires <= m_now)
+			{
+				--m_count;
+				expired.push_back(id);
+			}
+			else
+				link(id);
+			id = next;
+		}
+	}
+	if (target > m_now)
+		m_now = target;
+}
+
+int TimerWheel::nextTimeoutMs(uint64_t nowMs) const
+{
+	if (m_count == 0)
+		return -1;
+
+	// first busy level 0 slot, otherwise wake up at the next cascade
+	uint64_t ticks = SLOTS - (m_now & SLOT_MASK);
+	for (uint64_t i = 1; i < SLOTS; ++i)
+	{
+		uint64_t tick = m_now + i;
+		if (m_heads[0][tick & SLOT_MASK] != -1)
+		{
+			ticks = i;
+			break;
+		}
+		if ((tick & SLOT_MASK) == 0)
+			break;
+	}
+
+	uint64_t wakeMs = (m_now + ticks) * m_tickMs;
+	if (wakeMs <= nowMs)
+		return 0;
+	return static_cast<int>(wakeMs - nowMs);
+}
@@ -0,0 +1,155 @@
+#include "headers.hpp"
+
+// umask() can only be read by setting it; done once before main(), while no worker creates files
+static mode_t readUmask()
+{
+	mode_t mask = ::umask(0);
+	::umask(mask);
+	return mask;
+}
+
+// what an ofstream upload (handlePOST) gets; mkstemp() alone would leave 0600
+static const mode_t g_uploadMode = 0666 & ~readUmask();
+
+UploadStream::UploadStream() : m_fd(-1), m_partState(PART_NONE), m_failed(false) {}
+
+UploadStream::~UploadStream()
+{
+	abort();
+}
+
+bool UploadStream::open(const std::string &finalPath, const std::string &boundary)
+{
+	std::filesystem::path target(finalPath);
+	std::string tmpl = (target.parent_path() / ".upload_XXXXXX").string();
+
+	std::vector<char> name(tmpl.begin(), tmpl.end());
+	name.push_back('\0');
+	m_fd = ::mkstemp(name.data());
+	if (m_fd < 0)
+	{
+		perror("mkstemp");
+		return false;
+	}
+
+	m_tempPath = name.data();
+	m_finalPath = finalPath;
+	if (!boundary.empty())
+	{
+		m_delimiter = "--" + boundary;
+		m_partState = PART_HEADERS;
+	}
+	return true;
+}
+
+bool UploadStream::writeAll(const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = ::write(m_fd, data, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("write(upload)");
+			m_failed = true;
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool UploadStream::write(const char *data, size_t len)
+{
+	if (m_fd < 0 || m_failed)
+		return false;
+	if (m_partState == PART_NONE)
+		return writeAll(data, len);
+	if (m_partState == PART_DONE)
+		return true;
+
+	m_pending.append(data, len);
+
+	if (m_partState == PART_HEADERS)
+	{
+		size_t start = m_pending.find("\r\n\r\n");
+		if (start == std::string::npos)
+		{
+			if (m_pending.size() > MAX_PART_HEADER)
+				m_failed = true;
+			return !m_failed;
+		}
+		m_pending.erase(0, start + 4);
+		m_partState = PART_DATA;
+	}
+
+	// the delimiter may straddle two writes, so its length minus one byte stays buffered
+	size_t end = m_pending.find(m_delimiter);
+	if (end != std::string::npos)
+	{
+		while (end > 0 && (m_pending[end - 1] == '\n' || m_pending[end - 1] == '\r'))
+			end--;
+		m_partState = PART_DONE;
+		bool ok = writeAll(m_pending.data(), end);
+		m_pending.clear();
+		return ok;
+	}
+
+	if (m_pending.size() >= m_delimiter.size())
+	{
+		size_t safe = m_pending.size() - m_delimiter.size() + 1;
+		// trailing CR/LF may belong to the delimiter line
+		while (safe > 0 && (m_pending[safe - 1] == '\n' || m_pending[safe - 1] == '\r'))
+			safe--;
+		if (!writeAll(m_pending.data(), safe))
+			return false;
+		m_pending.erase(0, safe);
+	}
+	return true;
+}
+
+int UploadStream::commit()
+{
+	if (m_fd < 0 || m_failed)
+		return 500;
+	if (m_partState == PART_HEADERS)
+		return 400;
+	if (m_partState == PART_DATA && !writeAll(m_pending.data(), m_pending.size()))
+		return 500;
+	if (::fchmod(m_fd, g_uploadMode) < 0)
+	{
+		perror("fchmod");
+		abort();
+		return 500;
+	}
+
+	::close(m_fd);
+	m_fd = -1;
+
+	// link() refuses to replace an existing file, which keeps the 409 semantics of handlePOST
+	if (::link(m_tempPath.c_str(), m_finalPath.c_str()) < 0)
+	{
+		int code = (errno == EEXIST) ? 409 : 500;
+		abort();
+		return code;
+	}
+	::unlink(m_tempPath.c_str());
+	m_tempPath.clear();
+	return 0;
+}
+
+void UploadStream::abort()
+{
+	if (m_fd >= 0)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+	if (!m_tempPath.empty())
+	{
+		::unlink(m_tempPath.c_str());
+		m_tempPath.clear();
+	}
+}
@@ -0,0 +1,334 @@
+#include "headers.hpp"
+
+/**
+ * fcgi_echo <unix:/path.sock | [host:]port> [mpx]: a FastCGI responder to
+ * test fastcgi_pass against without php-fpm. Every request is answered
+ * with a text/plain page listing its params, then a blank line and the
+ * request body. The query string steers it:
+ *   delay=<ms>   answer that much later, other requests go on meanwhile;
+ *                an FCGI_ABORT_REQUEST for it is ignored, like a busy
+ *                application would
+ *   status=<n>   send "Status: <n>" instead of 200
+ * With "mpx" it announces FCGI_MPXS_CONNS=1 and takes several requests on
+ * one connection; otherwise the server keeps one in flight per connection.
+ */
+
+/**
+ * EchoRequest → a request whose streams are still coming in
+ * keepConn → FCGI_KEEP_CONN was set, the connection outlives the request
+ */
+struct EchoRequest
+{
+	std::string	params;
+	std::string	body;
+	bool		keepConn = false;
+};
+
+/**
+ * EchoConnection → one connection from the server
+ * closeAfterFlush → a request without FCGI_KEEP_CONN ended, close once outbuf is out
+ */
+struct EchoConnection
+{
+	std::string						inbuf;
+	std::string						outbuf;
+	std::map<uint16_t, EchoRequest>	requests;
+	bool							closeAfterFlush = false;
+};
+
+/**
+ * DelayedReply → an answer held back by delay=
+ * fd / serial → the connection it goes to, serial tells a reused fd apart
+ */
+struct DelayedReply
+{
+	std::chrono::steady_clock::time_point	due;
+	int										fd;
+	unsigned long							serial;
+	uint16_t								id;
+	std::string								records;
+	bool									keepConn;
+};
+
+static bool g_mpx = false;
+
+static int listenOn(const std::string &address)
+{
+	int fd = -1;
+	if (address.rfind("unix:", 0) == 0)
+	{
+		struct sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strncpy(addr.sun_path, address.c_str() + 5, sizeof(addr.sun_path) - 1);
+		::unlink(addr.sun_path);
+		fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 || ::bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0)
+		{
+			perror(address.c_str());
+			return -1;
+		}
+	}
+	else
+	{
+		size_t colon = address.rfind(':');
+		std::string host = colon == std::string::npos ? "" : address.substr(0, colon);
+		std::string port = colon == std::string::npos ? address : address.substr(colon + 1);
+
+		struct addrinfo hints;
+		struct addrinfo *res = NULL;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if (::getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+		{
+			std::cerr << address << ": cannot resolve" << std::endl;
+			return -1;
+		}
+		fd = ::socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int opt = 1;
+		if (fd >= 0)
+			::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		if (fd < 0 || ::bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+		{
+			perror(address.c_str());
+			::freeaddrinfo(res);
+			return -1;
+		}
+		::freeaddrinfo(res);
+	}
+	if (::listen(fd, SOMAXCONN) < 0)
+	{
+		perror("listen");
+		return -1;
+	}
+	return fd;
+}
+
+// value of name in a query string, empty when absent
+static std::string queryValue(const std::string &query, const std::string &name)
+{
+	std::istringstream pairs(query);
+	std::string pair;
+	while (std::getline(pairs, pair, '&'))
+	{
+		if (pair.compare(0, name.size() + 1, name + "=") == 0)
+			return pair.substr(name.size() + 1);
+	}
+	return "";
+}
+
+static void appendEndRequest(std::string &out, uint16_t id)
+{
+	// appStatus 0, FCGI_REQUEST_COMPLETE
+	const char end[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	fastCgiAppendRecord(out, FCGI_END_REQUEST, id, end, sizeof(end));
+}
+
+// STDOUT records of the echo page and the END_REQUEST closing it
+static std::string echoRecords(uint16_t id, const EchoRequest &request, long &delayMs)
+{
+	std::map<std::string, std::string> params = fastCgiDecodeParams(request.params.data(), request.params.size());
+	std::string query = params["QUERY_STRING"];
+	std::string status = queryValue(query, "status");
+	delayMs = std::strtol(queryValue(query, "delay").c_str(), NULL, 10);
+
+	std::string page = "Status: " + (status.empty() ? std::string("200") : status) + "\r\n"
+		+ "Content-Type: text/plain\r\n\r\n";
+	for (std::map<std::string, std::string>::const_iterator it = params.begin(); it != params.end(); ++it)
+		page += it->first + "=" + it->second + "\n";
+	page += "\n" + request.body;
+
+	std::string out;
+	for (size_t pos = 0; pos < page.size(); pos += FCGI_MAX_CONTENT)
+		fastCgiAppendRecord(out, FCGI_STDOUT, id, page.data() + pos, std::min(FCGI_MAX_CONTENT, page.size() - pos));
+	fastCgiAppendRecord(out, FCGI_STDOUT, id, "", 0);
+	appendEndRequest(out, id);
+	return out;
+}
+
+static void answerGetValues(EchoConnection &conn, const char *data, size_t len)
+{
+	std::map<std::string, std::string> query = fastCgiDecodeParams(data, len);
+	std::string result;
+	if (query.count("FCGI_MPXS_CONNS"))
+		fastCgiAppendParam(result, "FCGI_MPXS_CONNS", g_mpx ? "1" : "0");
+	if (query.count("FCGI_MAX_REQS"))
+		fastCgiAppendParam(result, "FCGI_MAX_REQS", "1024");
+	if (query.count("FCGI_MAX_CONNS"))
+		fastCgiAppendParam(result, "FCGI_MAX_CONNS", "1024");
+	fastCgiAppendRecord(conn.outbuf, FCGI_GET_VALUES_RESULT, 0, result.data(), result.size());
+}
+
+// handles every complete record of inbuf; false when the connection is to be dropped
+static bool handleRecords(int fd, unsigned long serial, EchoConnection &conn, std::vector<DelayedReply> &delayed)
+{
+	while (conn.inbuf.size() >= FCGI_HEADER_LEN)
+	{
+		const unsigned char *h = reinterpret_cast<const unsigned char *>(conn.inbuf.data());
+		if (h[0] != 1)
+			return false;
+		unsigned char type = h[1];
+		uint16_t id = static_cast<uint16_t>((h[2] << 8) | h[3]);
+		size_t contentLength = (static_cast<size_t>(h[4]) << 8) | h[5];
+		size_t total = FCGI_HEADER_LEN + contentLength + h[6];
+		if (conn.inbuf.size() < total)
+			return true;
+		const char *content = conn.inbuf.data() + FCGI_HEADER_LEN;
+
+		if (type == FCGI_GET_VALUES)
+			answerGetValues(conn, content, contentLength);
+		else if (type == FCGI_BEGIN_REQUEST && contentLength >= 8)
+		{
+			EchoRequest &request = conn.requests[id];
+			request = EchoRequest();
+			request.keepConn = content[2] & 1;
+		}
+		else if (type == FCGI_ABORT_REQUEST && conn.requests.erase(id))
+			appendEndRequest(conn.outbuf, id);
+		else if (type == FCGI_PARAMS && conn.requests.count(id))
+			conn.requests[id].params.append(content, contentLength);
+		else if (type == FCGI_STDIN && conn.requests.count(id))
+		{
+			if (contentLength)
+				conn.requests[id].body.append(content, contentLength);
+			else
+			{
+				EchoRequest request = conn.requests[id];
+				conn.requests.erase(id);
+				long delayMs = 0;
+				std::string records = echoRecords(id, request, delayMs);
+				if (delayMs > 0)
+				{
+					DelayedReply reply;
+					reply.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+					reply.fd = fd;
+					reply.serial = serial;
+					reply.id = id;
+					reply.records = records;
+					reply.keepConn = request.keepConn;
+					delayed.push_back(reply);
+				}
+				else
+				{
+					conn.outbuf += records;
+					conn.closeAfterFlush |= !request.keepConn;
+				}
+			}
+		}
+		conn.inbuf.erase(0, total);
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 2 && !(argc == 3 && std::string(argv[2]) == "mpx"))
+	{
+		std::cerr << "Usage: " << argv[0] << " <unix:/path.sock | [host:]port> [mpx]" << std::endl;
+		return 1;
+	}
+	g_mpx = argc == 3;
+	signal(SIGPIPE, SIG_IGN);
+
+	int listener = listenOn(argv[1]);
+	if (listener < 0)
+		return 1;
+	std::cout << "fcgi_echo listening on " << argv[1] << (g_mpx ? " (multiplexed)" : "") << std::endl;
+
+	std::map<int, EchoConnection> conns;
+	std::map<int, unsigned long> serials;
+	unsigned long nextSerial = 1;
+	std::vector<DelayedReply> delayed;
+
+	while (true)
+	{
+		int timeout = -1;
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < delayed.size(); ++i)
+		{
+			long wait = std::chrono::duration_cast<std::chrono::milliseconds>(delayed[i].due - now).count() + 1;
+			if (timeout < 0 || wait < timeout)
+				timeout = static_cast<int>(std::max(0L, wait));
+		}
+
+		std::vector<struct pollfd> fds(1);
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (std::map<int, EchoConnection>::iterator it = conns.begin(); it != conns.end(); ++it)
+		{
+			struct pollfd pfd;
+			pfd.fd = it->first;
+			pfd.events = POLLIN | (it->second.outbuf.empty() ? 0 : POLLOUT);
+			pfd.revents = 0;
+			fds.push_back(pfd);
+		}
+		if (::poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+		{
+			perror("poll");
+			return 1;
+		}
+
+		// replies whose delay ran out go to their connection, if it is still the same one
+		now = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < delayed.size();)
+		{
+			if (delayed[i].due > now)
+			{
+				++i;
+				continue;
+			}
+			if (conns.count(delayed[i].fd) && serials[delayed[i].fd] == delayed[i].serial)
+			{
+				conns[delayed[i].fd].outbuf += delayed[i].records;
+				conns[delayed[i].fd].closeAfterFlush |= !delayed[i].keepConn;
+			}
+			delayed.erase(delayed.begin() + i);
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			int fd = ::accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0)
+			{
+				conns[fd] = EchoConnection();
+				serials[fd] = nextSerial++;
+			}
+		}
+
+		for (size_t i = 1; i < fds.size(); ++i)
+		{
+			int fd = fds[i].fd;
+			EchoConnection &conn = conns[fd];
+			bool keep = true;
+
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				char buffer[65536];
+				ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+				if (n > 0)
+				{
+					conn.inbuf.append(buffer, n);
+					keep = handleRecords(fd, serials[fd], conn, delayed);
+				}
+				else
+					keep = false;
+			}
+			if (keep && !conn.outbuf.empty())
+			{
+				ssize_t n = ::send(fd, conn.outbuf.data(), conn.outbuf.size(), MSG_DONTWAIT);
+				if (n > 0)
+					conn.outbuf.erase(0, n);
+				else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+					keep = false;
+			}
+			if (!keep || (conn.closeAfterFlush && conn.outbuf.empty()))
+			{
+				::close(fd);
+				conns.erase(fd);
+				serials.erase(fd);
+			}
+		}
+	}
+}
@@ -0,0 +1,22 @@
+#include "headers.hpp"
+
+// mkpack <docroot> <output.pack> [index]: packs a docroot for the root_pack directive
+int main(int argc, char **argv)
+{
+	if (argc != 3 && argc != 4)
+	{
+		std::cerr << "Usage: " << argv[0] << " <docroot> <output.pack> [index]" << std::endl;
+		return 1;
+	}
+
+	std::string index = argc == 4 ? argv[3] : "index.html";
+	size_t assets = 0;
+	std::string error;
+	if (!writeAssetPack(argv[1], index, argv[2], assets, error))
+	{
+		std::cerr << "mkpack: " << error << std::endl;
+		return 1;
+	}
+	std::cout << "Packed " << assets << " files of " << argv[1] << " into " << argv[2] << std::endl;
+	return 0;
+}
@@ -0,0 +1,202 @@
+#include "headers.hpp"
+#include <sys/resource.h> // setrlimit()
+
+/**
+ * slow_clients <host> <port> [stalled] [requests] [path]: checks that
+ * clients trickling their headers do not slow anyone else down. It times
+ * requests sequential GETs of path on fresh connections, then opens
+ * stalled connections that send a partial request head and one more
+ * header line per second, times the same GETs again while they hang on,
+ * and reports both latency distributions and what became of the stalled
+ * connections (408, closed, still open).
+ */
+
+static int connectTo(const struct addrinfo *addr)
+{
+	int fd = ::socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (::connect(fd, addr->ai_addr, addr->ai_addrlen) < 0)
+	{
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// one GET on a fresh connection, read to the end; its latency in microseconds, -1 on failure
+static double timedGet(const struct addrinfo *addr, const std::string &request)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int fd = connectTo(addr);
+	if (fd < 0)
+		return -1;
+	if (::send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+	{
+		::close(fd);
+		return -1;
+	}
+	std::string response;
+	char buffer[16384];
+	ssize_t n;
+	while ((n = ::recv(fd, buffer, sizeof(buffer), 0)) > 0)
+		response.append(buffer, n);
+	::close(fd);
+	if (response.compare(0, 9, "HTTP/1.1 ") != 0 || response.compare(9, 1, "2") != 0)
+		return -1;
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char *phase, std::vector<double> &samples, size_t failed)
+{
+	if (samples.empty())
+	{
+		std::cout << phase << ": no successful request, " << failed << " failed" << std::endl;
+		return;
+	}
+	std::sort(samples.begin(), samples.end());
+	std::cout << std::left << std::setw(26) << phase << std::right << std::fixed << std::setprecision(0)
+			  << " p50 " << std::setw(6) << samples[samples.size() / 2] << " us"
+			  << "  p90 " << std::setw(6) << samples[samples.size() * 9 / 10] << " us"
+			  << "  p99 " << std::setw(6) << samples[samples.size() * 99 / 100] << " us"
+			  << "  max " << std::setw(7) << samples.back() << " us"
+			  << "  failed " << failed << std::endl;
+}
+
+static void runHealthy(const char *phase, const struct addrinfo *addr, const std::string &request, size_t count)
+{
+	std::vector<double> samples;
+	size_t failed = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		double us = timedGet(addr, request);
+		if (us < 0)
+			++failed;
+		else
+			samples.push_back(us);
+	}
+	report(phase, samples, failed);
+}
+
+/**
+ * StalledClients → the slow connections and what the server did with them
+ * timedOut → answered 408, closed → dropped without one
+ */
+struct StalledClients
+{
+	std::vector<int>	fds;
+	size_t				timedOut = 0;
+	size_t				closed = 0;
+};
+
+// sends each open stalled connection one more header line and collects the ones the server ended
+static void trickle(StalledClients &stalled)
+{
+	static const char line[] = "X-Trickle: 1\r\n";
+	for (size_t i = 0; i < stalled.fds.size(); ++i)
+	{
+		int fd = stalled.fds[i];
+		if (fd < 0)
+			continue;
+		char buffer[64];
+		ssize_t n = ::recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		bool ended = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+		if (n > 0)
+		{
+			if (std::string(buffer, n).compare(0, 12, "HTTP/1.1 408") == 0)
+				++stalled.timedOut;
+			else
+				++stalled.closed;
+		}
+		else if (ended || ::send(fd, line, sizeof(line) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+			++stalled.closed;
+		else
+			continue;
+		::close(fd);
+		stalled.fds[i] = -1;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 3 || argc > 6)
+	{
+		std::cerr << "Usage: " << argv[0] << " <host> <port> [stalled] [requests] [path]" << std::endl;
+		return 1;
+	}
+	size_t stalledCount = argc > 3 ? std::strtoul(argv[3], NULL, 10) : 2000;
+	size_t requests = argc > 4 ? std::strtoul(argv[4], NULL, 10) : 2000;
+	std::string path = argc > 5 ? argv[5] : "/";
+
+	struct addrinfo hints;
+	struct addrinfo *addr = NULL;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (::getaddrinfo(argv[1], argv[2], &hints, &addr) != 0 || !addr)
+	{
+		std::cerr << argv[1] << ":" << argv[2] << ": cannot resolve" << std::endl;
+		return 1;
+	}
+
+	struct rlimit limit;
+	if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < stalledCount + 64)
+	{
+		limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, stalledCount + 64);
+		::setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + argv[1] + "\r\nConnection: close\r\n\r\n";
+	runHealthy("healthy, alone", addr, request, requests);
+
+	StalledClients stalled;
+	std::string head = "GET " + path + " HTTP/1.1\r\nHost: " + argv[1] + "\r\n";
+	for (size_t i = 0; i < stalledCount; ++i)
+	{
+		int fd = connectTo(addr);
+		if (fd < 0 || ::send(fd, head.data(), head.size(), MSG_NOSIGNAL) < 0)
+		{
+			perror("stalled connection");
+			if (fd >= 0)
+				::close(fd);
+			break;
+		}
+		stalled.fds.push_back(fd);
+	}
+	std::cout << "opened " << stalled.fds.size() << " stalled connections" << std::endl;
+
+	// the stalled clients keep trickling once a second while the healthy ones are timed
+	std::mutex lock;
+	bool done = false;
+	std::thread trickler([&]() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (!done)
+		{
+			trickle(stalled);
+			guard.unlock();
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			guard.lock();
+		}
+	});
+	runHealthy("healthy, with stalled", addr, request, requests);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = true;
+	}
+	trickler.join();
+	trickle(stalled);
+
+	size_t open = 0;
+	for (size_t i = 0; i < stalled.fds.size(); ++i)
+	{
+		if (stalled.fds[i] >= 0)
+		{
+			++open;
+			::close(stalled.fds[i]);
+		}
+	}
+	std::cout << "stalled: " << stalled.timedOut << " got 408, " << stalled.closed << " closed without it, "
+			  << open << " still open" << std::endl;
+	::freeaddrinfo(addr);
+	return 0;
+}
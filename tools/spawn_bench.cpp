@@ -0,0 +1,131 @@
+#include "headers.hpp"
+
+/**
+ * spawn_bench [runs] [rss MB...]: how long starting a CGI child takes the
+ * parent as its resident set grows. For each size the heap is grown and
+ * touched to that many MB, then /bin/true is launched runs times with
+ * fork()+execve() and with spawnCgi(), the server's own launch path. Only
+ * the launch is timed, the child is reaped outside of it.
+ */
+
+typedef bool (*Launcher)(const CgiParams &params, CgiProcess &proc);
+
+static bool launchFork(const CgiParams &params, CgiProcess &proc)
+{
+	std::vector<std::string> env = buildCgiEnvironment(params);
+	std::vector<char *> envp;
+	for (size_t i = 0; i < env.size(); ++i)
+		envp.push_back(const_cast<char *>(env[i].c_str()));
+	envp.push_back(NULL);
+	char *argv[] = {const_cast<char *>("/bin/true"), NULL};
+
+	int inPipe[2];
+	int outPipe[2];
+	if (pipe2(inPipe, O_CLOEXEC) < 0)
+		return false;
+	if (pipe2(outPipe, O_CLOEXEC) < 0)
+	{
+		close(inPipe[0]);
+		close(inPipe[1]);
+		return false;
+	}
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		dup2(inPipe[0], STDIN_FILENO);
+		dup2(outPipe[1], STDOUT_FILENO);
+		execve(argv[0], argv, envp.data());
+		_exit(127);
+	}
+	close(inPipe[0]);
+	close(outPipe[1]);
+	proc.pid = pid;
+	proc.stdinFd = inPipe[1];
+	proc.stdoutFd = outPipe[0];
+	return pid > 0;
+}
+
+static bool launchSpawn(const CgiParams &params, CgiProcess &proc)
+{
+	return spawnCgi(params, "/bin/true", "", proc);
+}
+
+// mean, p50 and p99 in microseconds of runs launches
+static void measure(const char *name, Launcher launch, const CgiParams &params, size_t runs)
+{
+	std::vector<double> samples;
+	for (size_t i = 0; i < runs; ++i)
+	{
+		CgiProcess proc;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool ok = launch(params, proc);
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		if (!ok)
+		{
+			perror(name);
+			return;
+		}
+		samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+
+		close(proc.stdinFd);
+		close(proc.stdoutFd);
+		if (proc.pidFd >= 0)
+			close(proc.pidFd);
+		waitpid(proc.pid, NULL, 0);
+	}
+	std::sort(samples.begin(), samples.end());
+	double sum = 0;
+	for (size_t i = 0; i < samples.size(); ++i)
+		sum += samples[i];
+	std::cout << "  " << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(0)
+			  << " mean " << std::setw(7) << sum / samples.size() << " us"
+			  << "   p50 " << std::setw(7) << samples[samples.size() / 2] << " us"
+			  << "   p99 " << std::setw(7) << samples[samples.size() * 99 / 100] << " us" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	size_t runs = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 200;
+	std::vector<size_t> sizes;
+	for (int i = 2; i < argc; ++i)
+		sizes.push_back(std::strtoul(argv[i], NULL, 10));
+	if (!runs)
+	{
+		std::cerr << "Usage: " << argv[0] << " [runs] [rss MB...]" << std::endl;
+		return 1;
+	}
+	if (sizes.empty())
+	{
+		sizes.push_back(0);
+		sizes.push_back(256);
+		sizes.push_back(1024);
+	}
+	std::sort(sizes.begin(), sizes.end());
+
+	// a typical request's meta-variables, so both launchers build the same envp
+	CgiParams params;
+	params.push_back(std::make_pair("GATEWAY_INTERFACE", "CGI/1.1"));
+	params.push_back(std::make_pair("REQUEST_METHOD", "GET"));
+	params.push_back(std::make_pair("SCRIPT_NAME", "/cgi-bin/true"));
+	params.push_back(std::make_pair("QUERY_STRING", "a=1&b=2"));
+	params.push_back(std::make_pair("SERVER_PROTOCOL", "HTTP/1.1"));
+	params.push_back(std::make_pair("HTTP_USER_AGENT", "spawn_bench"));
+	params.push_back(std::make_pair("PATH", "/usr/local/bin:/usr/bin:/bin"));
+
+	std::vector<std::unique_ptr<char[]> > heap;
+	size_t allocated = 0;
+	const size_t chunk = 64 << 20;
+	for (size_t i = 0; i < sizes.size(); ++i)
+	{
+		while (allocated < sizes[i] << 20)
+		{
+			heap.push_back(std::unique_ptr<char[]>(new char[chunk]));
+			std::memset(heap.back().get(), 1, chunk);
+			allocated += chunk;
+		}
+		std::cout << "RSS +" << (allocated >> 20) << " MB, " << runs << " launches of /bin/true" << std::endl;
+		measure("fork+execve", launchFork, params, runs);
+		measure("spawnCgi", launchSpawn, params, runs);
+	}
+	return 0;
+}